@@ -1,229 +1,1527 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/cpu.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/intreadwrite.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
+#include <libavutil/avstring.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 
-int main(int argc, char *argv[]){
-  // confirm there is filename passed in
-  if(argc < 2)
-    return -1;
-  // check file extension
-  const char * ext = strrchr(argv[1], '.');
-  if((!ext) || (strcmp(ext, ".jpg")!=0)) {
-    return -1;
+// scalers kept across images, keyed by the source size and format
+#define SCALER_CACHE_SIZE 4
+
+// pictures in flight between two pipeline stages
+#define QUEUE_SIZE 4
+
+// frames between two bounces of the ball on the bottom of the picture
+#define BOUNCE_PERIOD 50
+
+// file and info headers followed by the palette of a raw 8-bit SPFF file
+#define SPFF_HEADER_SIZE (10 + 16 + 256 * 4)
+
+// steps timed for every picture
+enum {
+  STAT_OPEN,   // opening the file and reading the packet
+  STAT_PROBE,  // finding the stream parameters, demuxer only
+  STAT_DECODE,
+  STAT_SCALE,
+  STAT_ENCODE,
+  STAT_WRITE,
+  NB_STATS
+};
+
+static const char *const stat_names[NB_STATS] = {
+  "open", "probe", "decode", "scale", "encode", "write",
+};
+
+/*
+ * Instrumentation report, a JSON object listing every picture as soon as
+ * it is done, followed by the animation background if there is one and a
+ * summary of the run with the percentiles of the times of the pictures
+ * that were converted. The background is not one of the pictures.
+ */
+typedef struct Report {
+  FILE *file;
+  pthread_mutex_t lock;          // animation workers finish frames concurrently
+  int64_t (*times)[NB_STATS + 1]; // of the converted pictures, the total last
+  int nb_times;
+  int nb_images;
+  int nb_failed;
+  int64_t bytes[NB_STATS];       // over the run
+  int64_t start;                 // of the run
+  struct Job *background;        // of the animation, written at the end
+} Report;
+
+typedef struct ScalerEntry {
+  struct SwsContext *ctx;
+  int width, height;
+  enum AVPixelFormat format; // of the decoded picture
+} ScalerEntry;
+
+/*
+ * Contexts that stay alive from one image to the next in batch mode. In the
+ * pipeline each stage has its own thread and only touches its own fields.
+ */
+typedef struct Bouncer {
+  AVCodecContext *pCodecCtx;    // JPEG decoder, reused while the codec is the same
+  AVCodecContext *spff_context; // SPFF encoder, reopened when the size changes
+  ScalerEntry scalers[SCALER_CACHE_SIZE];
+  int next_scaler;              // entry replaced on a cache miss
+  enum AVPixelFormat pix_fmt;   // of the pictures given to the encoder
+  int nb_frames;                // of the animation, 0 to convert the pictures
+  int fast_open;                // recognize the pictures without the demuxer
+  int mmap;                     // read local pictures from a mapping of the file
+  int zero_copy;                // scale straight into a mapping of the .spff file
+  const char *report_filename;  // where the instrumentation goes, if anywhere
+  Report *report;
+  int verbose;
+  int nb_failed;                // pictures that could not be converted, counted by the last stage
+} Bouncer;
+
+// one picture going through the stages
+typedef struct Job {
+  char *filename;
+  char *spfffilename;
+  AVCodecParameters *par; // of the JPEG stream
+  AVPacket *packet;       // JPEG picture, then the SPFF one
+  AVFrame *frame;         // decoded picture, then the converted one
+  int ret;                // first error, the later stages pass the job on
+  int64_t time[NB_STATS];  // microseconds spent in every step, monotonic
+  int64_t bytes[NB_STATS]; // produced by every step
+} Job;
+
+/*
+ * Bounded queue between two stages, a ring with a single producer and a
+ * single consumer. Each index is only written by one side, so no lock is
+ * needed. A full queue holds the producer back until the consumer catches
+ * up, which keeps a fast stage from piling up pictures in memory.
+ */
+typedef struct JobQueue {
+  Job *jobs[QUEUE_SIZE];
+  atomic_uint head; // next job to pop, written by the consumer
+  atomic_uint tail; // next slot to fill, written by the producer
+} JobQueue;
+
+typedef struct Stage {
+  Bouncer *b;
+  int (*process)(Bouncer *b, Job *job);
+  int stat;      // step timed by the stage
+  JobQueue *in;
+  JobQueue *out; // NULL for the last stage, which retires the jobs
+  pthread_t thread;
+} Stage;
+
+// first bytes of the pictures that are opened without a demuxer
+static const struct {
+  enum AVCodecID codec_id;
+  int size;
+  uint8_t magic[8];
+} image_magics[] = {
+  { AV_CODEC_ID_MJPEG, 3, { 0xFF, 0xD8, 0xFF } },
+  { AV_CODEC_ID_PNG,   8, { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' } },
+  { AV_CODEC_ID_BMP,   2, { 'B', 'M' } },
+};
+
+// only .jpg files are converted
+static int is_jpg(const char *filename)
+{
+  const char *ext = strrchr(filename, '.');
+  return ext && !strcmp(ext, ".jpg");
+}
+
+// spin for a bit when the other side is about to be done, then sleep
+static void queue_wait(int *spins)
+{
+  if (++*spins < 64)
+    sched_yield();
+  else
+    av_usleep(100);
+}
+
+static void queue_push(JobQueue *q, Job *job)
+{
+  unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  int spins = 0;
+
+  while (tail - atomic_load_explicit(&q->head, memory_order_acquire) == QUEUE_SIZE)
+    queue_wait(&spins);
+  q->jobs[tail % QUEUE_SIZE] = job;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+static Job *queue_pop(JobQueue *q)
+{
+  unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  int spins = 0;
+  Job *job;
+
+  while (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+    queue_wait(&spins);
+  job = q->jobs[head % QUEUE_SIZE];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return job;
+}
+
+static void job_free(Job **pjob)
+{
+  Job *job = *pjob;
+
+  if (!job)
+    return;
+  av_freep(&job->filename);
+  av_freep(&job->spfffilename);
+  avcodec_parameters_free(&job->par);
+  av_packet_free(&job->packet);
+  av_frame_free(&job->frame);
+  av_freep(pjob);
+}
+
+static Job *job_alloc(const char *filename, const char *spfffilename)
+{
+  Job *job = av_mallocz(sizeof(*job));
+
+  if (!job)
+    return NULL;
+  job->filename     = av_strdup(filename);
+  job->spfffilename = av_strdup(spfffilename);
+  job->packet       = av_packet_alloc();
+  job->frame        = av_frame_alloc();
+  if (!job->filename || !job->spfffilename || !job->packet || !job->frame)
+    job_free(&job);
+  return job;
+}
+
+// swscale wants the limited range formats, the range is set separately
+static enum AVPixelFormat scaler_pix_fmt(enum AVPixelFormat pix_fmt)
+{
+  switch (pix_fmt) {
+  case AV_PIX_FMT_YUVJ420P :
+    return AV_PIX_FMT_YUV420P;
+  case AV_PIX_FMT_YUVJ422P  :
+    return AV_PIX_FMT_YUV422P;
+  case AV_PIX_FMT_YUVJ444P   :
+    return AV_PIX_FMT_YUV444P;
+  case AV_PIX_FMT_YUVJ440P :
+    return AV_PIX_FMT_YUV440P;
+  default:
+    return pix_fmt;
+  }
+}
+
+// look the scaler for this source up, replacing the oldest entry on a miss
+static struct SwsContext *get_scaler(Bouncer *b, int width, int height,
+                                     enum AVPixelFormat pix_fmt)
+{
+  ScalerEntry *e;
+  int i;
+
+  for (i = 0; i < SCALER_CACHE_SIZE; i++) {
+    e = &b->scalers[i];
+    if (e->ctx && e->width == width && e->height == height && e->format == pix_fmt)
+      return e->ctx;
+  }
+
+  e = &b->scalers[b->next_scaler];
+  b->next_scaler = (b->next_scaler + 1) % SCALER_CACHE_SIZE;
+
+  // the picture keeps its size, only the format changes, so no filter is
+  // needed and swscale uses its unscaled converters straight to the
+  // encoder format. The old context is freed by sws_getCachedContext()
+  // since its parameters differ.
+  e->ctx = sws_getCachedContext(e->ctx,
+                                width, height, scaler_pix_fmt(pix_fmt),
+                                width, height, b->pix_fmt,
+                                SWS_POINT, NULL, NULL, NULL);
+  e->width  = width;
+  e->height = height;
+  e->format = pix_fmt;
+  if (!e->ctx)
+    return NULL;
+
+  // JPEG pictures are full range
+  if (scaler_pix_fmt(pix_fmt) != pix_fmt)
+    sws_setColorspaceDetails(e->ctx, sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                             sws_getCoefficients(SWS_CS_DEFAULT), 1,
+                             0, 1 << 16, 1 << 16);
+  return e->ctx;
+}
+
+// open the decoder for the stream, or keep the one of the previous image
+static int open_decoder(Bouncer *b, const AVCodecParameters *par)
+{
+  AVCodec *pCodec;
+  int ret;
+
+  if (b->pCodecCtx && b->pCodecCtx->codec_id == par->codec_id) {
+    avcodec_flush_buffers(b->pCodecCtx);
+    return 0;
+  }
+  avcodec_free_context(&b->pCodecCtx);
+
+  // Find the decoder for jpg
+  pCodec = avcodec_find_decoder(par->codec_id);
+  if (!pCodec)
+    return AVERROR_DECODER_NOT_FOUND; // cannot find codec
+
+  b->pCodecCtx = avcodec_alloc_context3(pCodec);
+  if (!b->pCodecCtx)
+    return AVERROR(ENOMEM);
+  if ((ret = avcodec_parameters_to_context(b->pCodecCtx, par)) < 0)
+    return ret;
+
+  // Open codec
+  return avcodec_open2(b->pCodecCtx, pCodec, NULL);
+}
+
+// open the SPFF encoder, it only has to be reopened for another size
+static int open_encoder(Bouncer *b, int width, int height)
+{
+  AVCodec *spff_codec;
+
+  if (b->spff_context && b->spff_context->width == width &&
+      b->spff_context->height == height)
+    return 0;
+  avcodec_free_context(&b->spff_context);
+
+  // using example from https://github.com/aaronkchsu/FFMPEG-Bouncing-ball
+  //    /blob/master/bouncer/bouncer.c
+  // Find the codec for SPFF and allocate the context
+  spff_codec = avcodec_find_encoder(AV_CODEC_ID_SPFF);
+  if (!spff_codec)
+    return AVERROR_ENCODER_NOT_FOUND;
+  b->spff_context = avcodec_alloc_context3(spff_codec);
+  if (!b->spff_context)
+    return AVERROR(ENOMEM);
+
+  // set context variables
+  b->spff_context->width     = width;
+  b->spff_context->height    = height;
+  b->spff_context->pix_fmt   = b->pix_fmt;
+  b->spff_context->time_base = (AVRational){1,1};
+
+  // open codec
+  return avcodec_open2(b->spff_context, spff_codec, NULL);
+}
+
+/*
+ * Input of a mapped file. The mapping belongs to a buffer, so that the
+ * packets of the fast open path can reference it and keep it alive after
+ * the AVIOContext is gone.
+ */
+typedef struct MappedFile {
+  AVBufferRef *map;
+  int64_t pos;
+} MappedFile;
+
+// room of the AVIOContext used when the mapping goes through the demuxer
+#define MAPPED_IO_SIZE 32768
+
+static void mapped_file_unmap(void *opaque, uint8_t *data)
+{
+  munmap(data, (size_t)(uintptr_t)opaque);
+}
+
+/*
+ * Map a local file, followed by at least a zeroed page so that decoders can
+ * read the padding they expect after a packet. av_file_map() only maps the
+ * file, the page after it may not exist.
+ */
+static int mapped_file_map(const char *filename, AVBufferRef **map)
+{
+  const char *proto = avio_find_protocol_name(filename);
+  const char *path  = filename;
+  size_t page = sysconf(_SC_PAGESIZE), map_size;
+  struct stat st;
+  uint8_t *data;
+  int fd, ret = 0;
+
+  if (!proto || strcmp(proto, "file"))
+    return AVERROR(ENOSYS);
+  av_strstart(path, "file:", &path);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return AVERROR(errno);
+  if (fstat(fd, &st) < 0) {
+    ret = AVERROR(errno);
+    goto end;
+  }
+  if (!S_ISREG(st.st_mode) || !st.st_size ||
+      st.st_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+    ret = AVERROR(ENOSYS);
+    goto end;
   }
-  
+
+  // reserve the zeroed pages, then put the file over the first ones
+  map_size = FFALIGN(st.st_size, page) + page;
+  data = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data == MAP_FAILED) {
+    ret = AVERROR(errno);
+    goto end;
+  }
+  if (mmap(data, st.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    ret = AVERROR(errno);
+    munmap(data, map_size);
+    goto end;
+  }
+
+  *map = av_buffer_create(data, st.st_size, mapped_file_unmap,
+                          (void *)(uintptr_t)map_size, AV_BUFFER_FLAG_READONLY);
+  if (!*map) {
+    munmap(data, map_size);
+    ret = AVERROR(ENOMEM);
+  }
+end:
+  close(fd);
+  return ret;
+}
+
+static int mapped_file_read(void *opaque, uint8_t *buf, int buf_size)
+{
+  MappedFile *mf = opaque;
+  int size = FFMIN(buf_size, mf->map->size - mf->pos);
+
+  if (size <= 0)
+    return AVERROR_EOF;
+  memcpy(buf, mf->map->data + mf->pos, size);
+  mf->pos += size;
+  return size;
+}
+
+static int64_t mapped_file_seek(void *opaque, int64_t offset, int whence)
+{
+  MappedFile *mf = opaque;
+
+  switch (whence & ~AVSEEK_FORCE) {
+  case AVSEEK_SIZE:
+    return mf->map->size;
+  case SEEK_CUR:
+    offset += mf->pos;
+    break;
+  case SEEK_END:
+    offset += mf->map->size;
+    break;
+  }
+  if (offset < 0 || offset > mf->map->size)
+    return AVERROR(EINVAL);
+  return mf->pos = offset;
+}
+
+static void close_input(AVIOContext **pb)
+{
+  MappedFile *mf;
+
+  if (!*pb || (*pb)->read_packet != mapped_file_read) {
+    avio_closep(pb);
+    return;
+  }
+  mf = (*pb)->opaque;
+  av_buffer_unref(&mf->map);
+  av_freep(&mf);
+  av_freep(&(*pb)->buffer);
+  av_freep(pb);
+}
+
+/*
+ * Open the input of a picture, from a mapping of the file when asked for.
+ * Pictures that cannot be mapped, like those that are not local files, are
+ * read through their protocol.
+ */
+static int open_input(Bouncer *b, const char *filename, AVIOContext **pb)
+{
+  MappedFile *mf;
+  uint8_t *buf;
+
+  if (!b->mmap)
+    return avio_open(pb, filename, AVIO_FLAG_READ);
+
+  mf  = av_mallocz(sizeof(*mf));
+  buf = av_malloc(MAPPED_IO_SIZE);
+  if (!mf || !buf)
+    goto fail;
+  if (mapped_file_map(filename, &mf->map) < 0) {
+    av_free(mf);
+    av_free(buf);
+    return avio_open(pb, filename, AVIO_FLAG_READ);
+  }
+  *pb = avio_alloc_context(buf, MAPPED_IO_SIZE, 0, mf,
+                           mapped_file_read, NULL, mapped_file_seek);
+  if (!*pb)
+    goto fail;
+  return 0;
+
+fail:
+  if (mf)
+    av_buffer_unref(&mf->map);
+  av_free(mf);
+  av_free(buf);
+  return AVERROR(ENOMEM);
+}
+
+/*
+ * Fast open: the type of the picture is recognized from its first bytes and
+ * the whole file is its packet. Nothing is probed, so the picture is only
+ * decoded once, by the decode stage. Pictures that are not recognized, or
+ * whose size is unknown, go through the demuxer. A mapped file is not read,
+ * the packet references the mapping.
+ */
+static int read_image_fast(Bouncer *b, Job *job)
+{
+  AVIOContext *pb = NULL;
+  uint8_t magic[8];
+  int64_t size;
+  int i, ret;
+
+  if ((ret = open_input(b, job->filename, &pb)) < 0)
+    return ret;
+
+  size = avio_size(pb);
+  ret  = avio_read(pb, magic, sizeof(magic));
+  for (i = 0; i < FF_ARRAY_ELEMS(image_magics); i++)
+    if (ret >= image_magics[i].size &&
+        !memcmp(magic, image_magics[i].magic, image_magics[i].size))
+      break;
+  if (i == FF_ARRAY_ELEMS(image_magics) || size <= 0 ||
+      size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+    ret = AVERROR_DEMUXER_NOT_FOUND;
+    goto end;
+  }
+
+  job->par = avcodec_parameters_alloc();
+  if (!job->par) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  job->par->codec_type = AVMEDIA_TYPE_VIDEO;
+  job->par->codec_id   = image_magics[i].codec_id;
+
+  if (pb->read_packet == mapped_file_read) {
+    MappedFile *mf = pb->opaque;
+    job->packet->buf = av_buffer_ref(mf->map);
+    if (!job->packet->buf) {
+      ret = AVERROR(ENOMEM);
+      goto end;
+    }
+    job->packet->data   = mf->map->data;
+    job->packet->size   = mf->map->size;
+    job->packet->flags |= AV_PKT_FLAG_KEY;
+    goto end;
+  }
+
+  // the first bytes are still in the buffer of the context
+  if ((ret = avio_seek(pb, 0, SEEK_SET)) < 0 ||
+      (ret = av_new_packet(job->packet, size)) < 0)
+    goto end;
+  ret = avio_read(pb, job->packet->data, size);
+  if (ret >= 0 && ret != size)
+    ret = AVERROR_INVALIDDATA; // truncated while we were reading it
+  job->packet->flags |= AV_PKT_FLAG_KEY;
+
+end:
+  close_input(&pb);
+  return ret < 0 ? ret : 0;
+}
+
+// open the file with the demuxer and get the packet of the first picture
+static int read_image_demux(Bouncer *b, Job *job)
+{
   AVFormatContext *pFormatCtx = NULL;
-  int             videoStream=0,i,ret;
-  AVCodecContext  *pCodecCtx = NULL;
-  AVCodecContext  *pCodecCtxOrig = NULL;
-  AVCodec         *pCodec = NULL;
-  AVFrame         *pFrame = NULL; 
-  AVFrame         *pFrameRGB = NULL;
-  AVPacket        *packet=av_packet_alloc();
-  int             frameFinished;
-  int             numBytes;
-  uint8_t         *buffer = NULL;
-  char *filename = argv[1];
-  //register all codecs
-  av_register_all();
+  AVIOContext *pb = NULL;
+  int64_t t0;
+  int videoStream = -1, i, ret;
+
+  // the demuxer reads the mapping through our own context
+  if (b->mmap) {
+    if ((ret = open_input(b, job->filename, &pb)) < 0)
+      return ret;
+    pFormatCtx = avformat_alloc_context();
+    if (!pFormatCtx) {
+      close_input(&pb);
+      return AVERROR(ENOMEM);
+    }
+    pFormatCtx->pb     = pb;
+    pFormatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+  }
+
   //open file
-  ret = avformat_open_input(&pFormatCtx, argv[1], NULL, NULL);
+  if ((ret = avformat_open_input(&pFormatCtx, job->filename, NULL, NULL)) < 0) {
+    close_input(&pb);
+    return ret;
+  }
 
-  if (ret<0) abort();
-  
   // Retrieve stream information
-  if(avformat_find_stream_info(pFormatCtx, NULL)<0)
-    return -1; // Couldn't find stream information
+  t0  = av_gettime_relative();
+  ret = avformat_find_stream_info(pFormatCtx, NULL);
+  job->time[STAT_PROBE]  = av_gettime_relative() - t0;
+  job->bytes[STAT_PROBE] = pFormatCtx->pb ? avio_tell(pFormatCtx->pb) : 0;
+  if (ret < 0)
+    goto end; // Couldn't find stream information
 
   // Dump information about file onto standard error
-  av_dump_format(pFormatCtx, 0, argv[1], 0);
+  if (b->verbose)
+    av_dump_format(pFormatCtx, 0, job->filename, 0);
 
   // Find the first video stream
-  videoStream=-1;
-  for(i=0; i<pFormatCtx->nb_streams; i++)
-    if(pFormatCtx->streams[i]->codecpar->codec_type==AVMEDIA_TYPE_VIDEO) {
-      videoStream=i;
+  for (i = 0; i < pFormatCtx->nb_streams; i++)
+    if (pFormatCtx->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+      videoStream = i;
       break;
     }
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER FIND VIDEO STREAM, VIDEOSTREAM = %d \n", videoStream);
-  if(videoStream==-1)
-    return -1; // Didn't find a video stream
+  if (videoStream == -1) {
+    ret = AVERROR_STREAM_NOT_FOUND; // Didn't find a video stream
+    goto end;
+  }
 
- 
-  // Find the decoder for jpg
-  pCodec = avcodec_find_decoder(pFormatCtx->streams[i]->codecpar->codec_id);
+  job->par = avcodec_parameters_alloc();
+  if (!job->par) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  if ((ret = avcodec_parameters_copy(job->par, pFormatCtx->streams[videoStream]->codecpar)) < 0)
+    goto end;
 
-  if (pCodec==NULL)
-    {
-      return -1; // cannot find codec
-    }
+  // Is this a packet from the video stream?
+  while ((ret = av_read_frame(pFormatCtx, job->packet)) >= 0 &&
+         job->packet->stream_index != videoStream)
+    av_packet_unref(job->packet);
 
-  //copy codec context before opening codec
-  pCodecCtx=avcodec_alloc_context3(pCodec);
+end:
+  avformat_close_input(&pFormatCtx);
+  close_input(&pb);
+  return ret;
+}
 
-  // Get a pointer to the codec context for the video stream
-  avcodec_parameters_to_context(pCodecCtx, pFormatCtx->streams[videoStream]->codecpar);
+// read stage: get the packet of the first picture
+static int read_image(Bouncer *b, Job *job)
+{
+  int ret = AVERROR_DEMUXER_NOT_FOUND;
 
- 
-  // Open codec
-  if(avcodec_open2(pCodecCtx, pCodec, NULL)<0)
-    {
-      return -1; // cannot find codec
+  if (b->fast_open)
+    ret = read_image_fast(b, job);
+  if (ret == AVERROR_DEMUXER_NOT_FOUND)
+    ret = read_image_demux(b, job);
+  job->bytes[STAT_OPEN] = job->packet->size;
+  return ret;
+}
+
+// decode stage
+static int decode_image(Bouncer *b, Job *job)
+{
+  int ret;
+
+  if ((ret = open_decoder(b, job->par)) < 0)
+    return ret;
+
+  // Decode video frame
+  ret = avcodec_send_packet(b->pCodecCtx, job->packet);
+  av_packet_unref(job->packet);
+  if (ret >= 0)
+    ret = avcodec_receive_frame(b->pCodecCtx, job->frame);
+  if (ret == AVERROR(EAGAIN))
+    ret = AVERROR_INVALIDDATA;
+  if (ret >= 0)
+    job->bytes[STAT_DECODE] = FFMAX(av_image_get_buffer_size(job->frame->format,
+                                                             job->frame->width,
+                                                             job->frame->height, 1), 0);
+  return ret;
+}
+
+// headers of a raw 8-bit file, the same ones as the encoder writes
+static void put_spff_header(uint8_t *buf, enum AVPixelFormat pix_fmt,
+                            int width, int height, int hsize, int size)
+{
+  int i, r, g, b;
+
+  buf[0] = 'S';                     // SPFFFILEHEADER.bfType
+  buf[1] = 'F';                     // do.
+  AV_WL32(buf +  2, size);          // SPFFFILEHEADER.bfSize
+  AV_WL32(buf +  6, hsize);         // SPFFFILEHEADER.bfOffBits
+  AV_WL32(buf + 10, 16);            // SPFFINFOHEADER.biSize
+  AV_WL32(buf + 14, width);         // SPFFINFOHEADER.biWidth
+  AV_WL32(buf + 18, height);        // SPFFINFOHEADER.biHeight, bottom-up
+  AV_WL16(buf + 22, 1);             // SPFFINFOHEADER.biPlanes
+  AV_WL16(buf + 24, 8);             // SPFFINFOHEADER.biBitCount
+
+  // systematic palette of the 3-3-2 format
+  for (i = 0; i < 256; i++) {
+    if (pix_fmt == AV_PIX_FMT_RGB8) {
+      r = (i >> 5)     * 36;
+      g = (i >> 2 & 7) * 36;
+      b = (i & 3)      * 85;
+    } else {
+      b = (i >> 6)     * 85;
+      g = (i >> 3 & 7) * 36;
+      r = (i & 7)      * 36;
     }
-  av_log(pFormatCtx, AV_LOG_INFO, "PRINT CODEC HIGHT %d, Width %d \n", pCodecCtx->height, pCodecCtx->width);
+    AV_WL32(buf + 26 + 4 * i, r << 16 | g << 8 | b);
+  }
+}
 
-  
- 
-  switch (pCodecCtx->pix_fmt) {
-  case AV_PIX_FMT_YUVJ420P :
-    pCodecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
-    break;
-  case AV_PIX_FMT_YUVJ422P  :
-    pCodecCtx->pix_fmt = AV_PIX_FMT_YUV422P;
+/*
+ * Zero copy output: the .spff file is created at its final size and mapped,
+ * the headers are written in place and the scaler writes the rows straight
+ * into the file, last row first through a negative linesize, each row
+ * padded to 4 bytes. The rows start 4-byte aligned like in the files of
+ * the encoder. There is no converted frame, no packet and no write.
+ */
+static int scale_image_to_file(Bouncer *b, Job *job)
+{
+  AVFrame *pFrame = job->frame;
+  struct SwsContext *sws_ctx;
+  uint8_t *map, *dst[4] = { NULL };
+  int dst_linesize[4] = { 0 };
+  int row_size = FFALIGN(pFrame->width, 4);
+  int hsize    = FFALIGN(SPFF_HEADER_SIZE, 4);
+  int64_t size = hsize + (int64_t)row_size * pFrame->height;
+  int fd, ret = 0;
+
+  sws_ctx = get_scaler(b, pFrame->width, pFrame->height, pFrame->format);
+  if (!sws_ctx)
+    return AVERROR(EINVAL);
+  if (size > INT_MAX)
+    return AVERROR(EFBIG);
+
+  fd = open(job->spfffilename, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return AVERROR(errno);
+  // the file is zeroed, which is the padding after the palette and the rows
+  if (ftruncate(fd, size) < 0) {
+    ret = AVERROR(errno);
+    goto fail;
+  }
+  map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    ret = AVERROR(errno);
+    goto fail;
+  }
+
+  put_spff_header(map, b->pix_fmt, pFrame->width, pFrame->height, hsize, size);
+  dst[0]          = map + size - row_size;
+  dst_linesize[0] = -row_size;
+  ret = sws_scale(sws_ctx,
+                  (uint8_t const * const *)(pFrame->data),
+                  pFrame->linesize,
+                  0,
+                  pFrame->height,
+                  dst,
+                  dst_linesize);
+  munmap(map, size);
+  // a short scale would leave rows of the file unwritten
+  if (ret != pFrame->height) {
+    ret = AVERROR_EXTERNAL;
+    goto fail;
+  }
+  ret = 0;
+  job->bytes[STAT_SCALE] = size;
+
+  if (close(fd) < 0)
+    ret = AVERROR(errno);
+  av_frame_unref(job->frame);
+  return ret;
+
+fail:
+  // no empty or partly sized file is left behind
+  close(fd);
+  unlink(job->spfffilename);
+  av_frame_unref(job->frame);
+  return ret;
+}
+
+// scale stage: convert the decoded picture to the encoder format
+static int scale_image(Bouncer *b, Job *job)
+{
+  AVFrame *pFrame = job->frame;
+  AVFrame *pFrameRGB;
+  struct SwsContext *sws_ctx;
+  int ret;
+
+  if (b->zero_copy)
+    return scale_image_to_file(b, job);
+
+  // use swscaling to convert jpeg to the encoder format
+  sws_ctx = get_scaler(b, pFrame->width, pFrame->height, pFrame->format);
+  if (!sws_ctx)
+    return AVERROR(EINVAL);
+
+  pFrameRGB = av_frame_alloc();
+  if (!pFrameRGB)
+    return AVERROR(ENOMEM);
+  pFrameRGB->format = b->pix_fmt;
+  pFrameRGB->width  = pFrame->width;
+  pFrameRGB->height = pFrame->height;
+  if ((ret = av_frame_get_buffer(pFrameRGB, 32)) < 0) {
+    av_frame_free(&pFrameRGB);
+    return ret;
+  }
+
+  // Convert the image from its native format to RGB, in a single pass
+  if (sws_scale(sws_ctx,
+                (uint8_t const * const *)(pFrame->data),
+                pFrame->linesize,
+                0,
+                pFrame->height,
+                pFrameRGB->data,
+                pFrameRGB->linesize) != pFrame->height) {
+    av_frame_free(&pFrameRGB);
+    return AVERROR_EXTERNAL;
+  }
+
+  job->bytes[STAT_SCALE] = FFMAX(av_image_get_buffer_size(b->pix_fmt, pFrame->width,
+                                                          pFrame->height, 1), 0);
+  av_frame_free(&job->frame);
+  job->frame = pFrameRGB;
+  return 0;
+}
+
+// encode stage
+static int encode_image(Bouncer *b, Job *job)
+{
+  int ret;
+
+  // the picture is already in its file
+  if (b->zero_copy)
+    return 0;
+
+  if ((ret = open_encoder(b, job->frame->width, job->frame->height)) < 0)
+    return ret;
+
+  // encode the spff_frame in spff format, the packet is allocated by the
+  // spff encoder
+  if ((ret = avcodec_send_frame(b->spff_context, job->frame)) < 0)
+    return ret;
+  av_frame_unref(job->frame);
+  if ((ret = avcodec_receive_packet(b->spff_context, job->packet)) < 0)
+    return ret;
+  job->bytes[STAT_ENCODE] = job->packet->size;
+  return 0;
+}
+
+// write stage
+static int write_image(Bouncer *b, Job *job)
+{
+  FILE *file;
+  int ret = 0;
+
+  if (b->zero_copy)
+    return 0;
+
+  // write all bytes of spff_packet to file
+  file = fopen(job->spfffilename, "wb"); //create a file using the filename
+  if (!file)
+    return AVERROR(errno);
+  if (fwrite(job->packet->data, 1, job->packet->size, file) != job->packet->size)
+    ret = AVERROR(EIO);
+  if (fclose(file))
+    ret = AVERROR(EIO);
+  if (!ret)
+    job->bytes[STAT_WRITE] = job->packet->size;
+  av_packet_unref(job->packet);
+  return ret;
+}
+
+static const struct {
+  int (*process)(Bouncer *b, Job *job);
+  int stat;
+} stages[] = {
+  { read_image,   STAT_OPEN   },
+  { decode_image, STAT_DECODE },
+  { scale_image,  STAT_SCALE  },
+  { encode_image, STAT_ENCODE },
+  { write_image,  STAT_WRITE  },
+};
+#define NB_STAGES (sizeof(stages) / sizeof(stages[0]))
+
+static int run_stage(Bouncer *b, Job *job, int (*process)(Bouncer *b, Job *job),
+                     int stat)
+{
+  int64_t t0 = av_gettime_relative();
+  int ret = process(b, job);
+
+  job->time[stat] += av_gettime_relative() - t0;
+  // the read stage times its probe apart
+  if (stat == STAT_OPEN)
+    job->time[STAT_OPEN] -= job->time[STAT_PROBE];
+  return ret;
+}
+
+static void put_json_string(FILE *file, const char *str)
+{
+  fputc('"', file);
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      fprintf(file, "\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      fprintf(file, "\\u%04x", *str);
+    else
+      fputc(*str, file);
+  }
+  fputc('"', file);
+}
+
+// peak resident size of the process in kilobytes, not the allocated bytes
+static int64_t peak_rss_kb(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+  return ru.ru_maxrss;
+}
+
+static int report_open(Report *r, const char *filename)
+{
+  r->file = fopen(filename, "w");
+  if (!r->file)
+    return AVERROR(errno);
+  pthread_mutex_init(&r->lock, NULL);
+  r->start = av_gettime_relative();
+  fprintf(r->file, "{\n\"images\": [");
+  return 0;
+}
+
+// the fields of a job, without the closing brace, returns its total time
+static int64_t put_json_job(FILE *file, const Job *job)
+{
+  int64_t total = 0;
+  int i;
+
+  fprintf(file, "{\"file\": ");
+  put_json_string(file, job->filename);
+  // the animation background has no file of its own
+  if (*job->spfffilename) {
+    fprintf(file, ", \"output\": ");
+    put_json_string(file, job->spfffilename);
+  }
+  fprintf(file, ", \"error\": ");
+  if (job->ret < 0)
+    put_json_string(file, av_err2str(job->ret));
+  else
+    fprintf(file, "null");
+  fprintf(file, ",\n   \"time_us\": {");
+  for (i = 0; i < NB_STATS; i++) {
+    fprintf(file, "\"%s\": %"PRId64", ", stat_names[i], job->time[i]);
+    total += job->time[i];
+  }
+  fprintf(file, "\"total\": %"PRId64"},\n   \"bytes\": {", total);
+  for (i = 0; i < NB_STATS; i++)
+    fprintf(file, "%s\"%s\": %"PRId64, i ? ", " : "", stat_names[i], job->bytes[i]);
+  fprintf(file, "}");
+  return total;
+}
+
+static void report_job(Report *r, const Job *job)
+{
+  int64_t total;
+  int i;
+
+  pthread_mutex_lock(&r->lock);
+  fprintf(r->file, "%s\n  ", r->nb_images ? "," : "");
+  total = put_json_job(r->file, job);
+  for (i = 0; i < NB_STATS; i++)
+    r->bytes[i] += job->bytes[i];
+  fprintf(r->file, ", \"peak_rss_kb\": %"PRId64"}", peak_rss_kb());
+  r->nb_images++;
+
+  // failed pictures stop early, they would pull the percentiles down
+  if (job->ret < 0) {
+    r->nb_failed++;
+  } else if (av_reallocp_array(&r->times, r->nb_times + 1, sizeof(*r->times)) >= 0) {
+    memcpy(r->times[r->nb_times], job->time, sizeof(job->time));
+    r->times[r->nb_times++][NB_STATS] = total;
+  } else {
+    r->nb_times = 0;
+  }
+  pthread_mutex_unlock(&r->lock);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// write the summary and close the report
+static void report_close(Report *r)
+{
+  int64_t *sorted;
+  int i, j;
+
+  if (!r->file)
+    return;
+  fprintf(r->file, "\n],\n");
+  if (r->background) {
+    fprintf(r->file, "\"background\": ");
+    put_json_job(r->file, r->background);
+    fprintf(r->file, "},\n");
+    job_free(&r->background);
+  }
+  fprintf(r->file, "\"summary\": {\"images\": %d, \"failed\": %d, "
+          "\"wall_us\": %"PRId64", \"peak_rss_kb\": %"PRId64",\n  \"bytes\": {",
+          r->nb_images, r->nb_failed, av_gettime_relative() - r->start, peak_rss_kb());
+  for (i = 0; i < NB_STATS; i++)
+    fprintf(r->file, "%s\"%s\": %"PRId64, i ? ", " : "", stat_names[i], r->bytes[i]);
+  fprintf(r->file, "},\n  \"time_us\": {");
+
+  // nearest rank percentiles of every step and of the total
+  sorted = av_malloc_array(FFMAX(r->nb_times, 1), sizeof(*sorted));
+  for (i = 0; sorted && i <= NB_STATS; i++) {
+    static const int percentiles[] = { 50, 95, 99 };
+
+    for (j = 0; j < r->nb_times; j++)
+      sorted[j] = r->times[j][i];
+    qsort(sorted, r->nb_times, sizeof(*sorted), cmp_int64);
+    fprintf(r->file, "%s\n    \"%s\": {", i ? "," : "",
+            i < NB_STATS ? stat_names[i] : "total");
+    for (j = 0; j < FF_ARRAY_ELEMS(percentiles); j++)
+      fprintf(r->file, "%s\"p%d\": %"PRId64, j ? ", " : "", percentiles[j],
+              r->nb_times ? sorted[FFMAX((r->nb_times * percentiles[j] + 99) / 100 - 1, 0)] : 0);
+    fprintf(r->file, "}");
+  }
+  fprintf(r->file, "}}}\n");
+  av_free(sorted);
+
+  if (fclose(r->file))
+    av_log(NULL, AV_LOG_ERROR, "cannot write the report: %s\n", av_err2str(AVERROR(errno)));
+  pthread_mutex_destroy(&r->lock);
+  av_freep(&r->times);
+}
+
+// the job is done, successfully or not
+static void job_finish(Bouncer *b, Job **job)
+{
+  if ((*job)->ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "%s: %s\n", (*job)->filename, av_err2str((*job)->ret));
+    b->nb_failed++;
+  }
+  if (b->report)
+    report_job(b->report, *job);
+  job_free(job);
+}
+
+// the animation background is done, the report keeps it apart from the
+// pictures so that it does not count in their percentiles
+static void background_finish(Bouncer *b, Job **job)
+{
+  if ((*job)->ret < 0) {
+    av_log(NULL, AV_LOG_ERROR, "%s: %s\n", (*job)->filename, av_err2str((*job)->ret));
+    b->nb_failed++;
+  }
+  if (b->report) {
+    b->report->background = *job;
+    *job = NULL;
+  } else
+    job_free(job);
+}
+
+// convert a single picture, running the stages one after the other
+static int convert_image(Bouncer *b, const char *filename, const char *spfffilename)
+{
+  Job *job = job_alloc(filename, spfffilename);
+  int i, ret;
+
+  if (!job)
+    return AVERROR(ENOMEM);
+  for (i = 0; i < NB_STAGES && job->ret >= 0; i++)
+    job->ret = run_stage(b, job, stages[i].process, stages[i].stat);
+  ret = job->ret;
+  job_finish(b, &job);
+  return ret;
+}
+
+static void *stage_thread(void *arg)
+{
+  Stage *s = arg;
+  Job *job;
+
+  // a NULL job marks the end of the batch
+  while ((job = queue_pop(s->in))) {
+    if (job->ret >= 0)
+      job->ret = run_stage(s->b, job, s->process, s->stat);
+    if (s->out)
+      queue_push(s->out, job);
+    else
+      job_finish(s->b, &job);
+  }
+  if (s->out)
+    queue_push(s->out, NULL);
+  return NULL;
+}
+
+/*
+ * Batch mode runs every stage on its own thread, the pictures are handed
+ * from one stage to the next through bounded queues. Reading, decoding and
+ * encoding different pictures overlap and the batch goes as fast as the
+ * slowest stage.
+ */
+typedef struct Pipeline {
+  Stage stages[NB_STAGES];
+  JobQueue queues[NB_STAGES];
+  int nb_started;
+} Pipeline;
+
+static int pipeline_start(Pipeline *p, Bouncer *b)
+{
+  int i, ret;
+
+  for (i = 0; i < NB_STAGES; i++) {
+    Stage *s   = &p->stages[i];
+    s->b       = b;
+    s->process = stages[i].process;
+    s->stat    = stages[i].stat;
+    s->in      = &p->queues[i];
+    s->out     = i + 1 < NB_STAGES ? &p->queues[i + 1] : NULL;
+    atomic_init(&s->in->head, 0);
+    atomic_init(&s->in->tail, 0);
+  }
+  for (; p->nb_started < NB_STAGES; p->nb_started++)
+    if ((ret = pthread_create(&p->stages[p->nb_started].thread, NULL,
+                              stage_thread, &p->stages[p->nb_started])))
+      return AVERROR(ret);
+  return 0;
+}
+
+// let the pictures queued so far go through and stop the threads
+static void pipeline_stop(Pipeline *p)
+{
+  Job *job;
+  int i;
+
+  if (p->nb_started < NB_STAGES) {
+    // a thread is missing, drop the jobs that cannot go any further
+    queue_push(&p->queues[0], NULL);
+    for (i = 0; i < p->nb_started; i++)
+      pthread_join(p->stages[i].thread, NULL);
+    while ((job = queue_pop(&p->queues[p->nb_started])))
+      job_free(&job);
+    return;
+  }
+  queue_push(&p->queues[0], NULL);
+  for (i = 0; i < NB_STAGES; i++)
+    pthread_join(p->stages[i].thread, NULL);
+}
+
+// in batch mode every picture.jpg becomes picture.spff next to it
+static int batch_add(Pipeline *p, const char *filename)
+{
+  char spfffilename[4096];
+  size_t len = strlen(filename) - strlen(".jpg");
+  Job *job;
+
+  if (len + sizeof(".spff") > sizeof(spfffilename))
+    return AVERROR(ENAMETOOLONG);
+  memcpy(spfffilename, filename, len);
+  strcpy(spfffilename + len, ".spff");
+
+  job = job_alloc(filename, spfffilename);
+  if (!job)
+    return AVERROR(ENOMEM);
+  queue_push(&p->queues[0], job);
+  return 0;
+}
+
+// queue all the .jpg files of a directory
+static int batch_add_dir(Pipeline *p, const char *dirname)
+{
+  char filename[4096];
+  struct dirent *entry;
+  DIR *dir = opendir(dirname);
+  int ret = 0;
+
+  if (!dir)
+    return AVERROR(errno);
+  while ((entry = readdir(dir))) {
+    if (!is_jpg(entry->d_name))
+      continue;
+    if (snprintf(filename, sizeof(filename), "%s/%s", dirname, entry->d_name) >=
+        sizeof(filename))
+      ret = AVERROR(ENAMETOOLONG);
+    else if ((ret = batch_add(p, filename)) < 0)
+      break;
+  }
+  closedir(dir);
+  return ret;
+}
+
+static void bouncer_free(Bouncer *b)
+{
+  int i;
+
+  avcodec_free_context(&b->pCodecCtx);
+  avcodec_free_context(&b->spff_context);
+  for (i = 0; i < SCALER_CACHE_SIZE; i++)
+    sws_freeContext(b->scalers[i].ctx);
+}
+
+/*
+ * A ball bouncing over a picture. Every frame only depends on its index, so
+ * the frames are shared between workers, each with its own encoder and its
+ * own copy of the background. A worker restores the box of the ball it drew
+ * last from the background and draws the ball in its new box, the rest of
+ * its picture is never touched again.
+ *
+ * Only the drawing is incremental. Every frame is a standalone .spff file
+ * that must open on its own, so each one is a full intra encode and a full
+ * write. Inter frames (keyint, dirty rectangles) only store what changed
+ * since the previous file and cannot be decoded without it, and the
+ * previous frame may not even come from the same worker.
+ */
+typedef struct Animation {
+  const char *filename;   // of the background
+  AVFrame *background;    // converted to the encoder format
+  int nb_frames;
+  atomic_int next_frame;  // next frame to render, taken by the workers
+  int bpp;                // bytes per pixel
+  int size;               // of the box of the ball
+  uint8_t *ball;          // size x size pixels, only the spans are drawn
+  int *span_start;        // part of each row of the box covered by the ball
+  int *span_end;
+} Animation;
+
+typedef struct Worker {
+  Animation *a;
+  Bouncer b;              // for the encoder, the errors are counted there
+  AVFrame *canvas;        // background with the ball drawn last
+  int x, y;               // box of that ball, x is -1 before the first frame
+  pthread_t thread;
+} Worker;
+
+static void put_color(uint8_t *p, enum AVPixelFormat pix_fmt, int r, int g, int b)
+{
+  switch (pix_fmt) {
+  case AV_PIX_FMT_RGB24:
+    p[0] = r;
+    p[1] = g;
+    p[2] = b;
     break;
-  case AV_PIX_FMT_YUVJ444P   :
-    pCodecCtx->pix_fmt = AV_PIX_FMT_YUV444P;
+  case AV_PIX_FMT_RGB8:
+    p[0] = (r * 7 + 127) / 255 << 5 | (g * 7 + 127) / 255 << 2 | (b * 3 + 127) / 255;
     break;
-  case AV_PIX_FMT_YUVJ440P :
-    pCodecCtx->pix_fmt = AV_PIX_FMT_YUV440P;
   default:
-    pCodecCtx->pix_fmt = pCodec->pix_fmts[0];
+    p[0] = (b * 3 + 127) / 255 << 6 | (g * 7 + 127) / 255 << 3 | (r * 7 + 127) / 255;
     break;
   }
+}
 
+// shade the ball once, lit from the top left
+static int ball_init(Animation *a, enum AVPixelFormat pix_fmt)
+{
+  float r = a->size / 2.0f;
+  int x, y;
 
-  av_log(pCodecCtx,AV_LOG_INFO,"PRINT BEFORE GET CACHED CONTEXT format %d \n",av_get_pix_fmt_name(pCodecCtx->pix_fmt));
-
-  av_log(pCodecCtx,AV_LOG_INFO,"PRINT BEFORE GET CACHED CONTEXT, WIDTH %d, HEIGHT %d, format %d \n",pCodecCtx->width,pCodecCtx->height,pCodecCtx->pix_fmt);
-  
-  // use swscaling to convert jpeg to RGB24
-  struct SwsContext *sws_ctx = NULL;
+  a->ball       = av_malloc_array(a->size, a->size * a->bpp);
+  a->span_start = av_malloc_array(a->size, sizeof(*a->span_start));
+  a->span_end   = av_malloc_array(a->size, sizeof(*a->span_end));
+  if (!a->ball || !a->span_start || !a->span_end)
+    return AVERROR(ENOMEM);
 
-  // scaling to open new image under RGB24
-  sws_ctx = sws_getCachedContext(NULL,
-				 pCodecCtx->width,
-				 pCodecCtx->height,
-				 pCodecCtx->pix_fmt,
-				 pCodecCtx->width,
-				 pCodecCtx->height,
-				 AV_PIX_FMT_RGB24,
-				 SWS_BICUBIC, 
-				 NULL, NULL,NULL);
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER GET CACHED CONTEXT, WIDTH %d, HEIGHT %d, format %d \n",pCodecCtx->width,pCodecCtx->height,pCodecCtx->pix_fmt);
+  for (y = 0; y < a->size; y++) {
+    float dy   = y + 0.5f - r;
+    float half = sqrtf(FFMAX(r * r - dy * dy, 0));
 
-  // allocate frame
-  pFrame = av_frame_alloc();
-  // Allocate an AVFrame structure
-  pFrameRGB=av_frame_alloc();
-  if(pFrameRGB==NULL)
-    return -1;
-  // Determine required buffer size and allocate buffer
-  numBytes = av_image_get_buffer_size(AV_PIX_FMT_RGB24, pCodecCtx->width,pCodecCtx->height, 32);
-  buffer = (uint8_t *) av_malloc(numBytes * sizeof(uint8_t));
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT BEFORE AV IMAGE FILL, numBytes %d\n", numBytes);
-  // Assign appropriate parts of buffer to image planes in pFrameRGB
-  av_image_fill_arrays(pFrameRGB->data, pFrameRGB->linesize, buffer, AV_PIX_FMT_RGB24, pCodecCtx->width, pCodecCtx->height, 32);
-
-  if (av_read_frame(pFormatCtx, packet)>=0){
-    // Is this a packet from the video stream?
-    if(packet->stream_index==videoStream) {
-     
-      // Decode video frame
-      int ret = avcodec_send_packet(pCodecCtx, packet);
-      ret = avcodec_receive_frame(pCodecCtx, pFrame);
-     
-    
-      av_log(pFormatCtx,AV_LOG_INFO,"PRINT BEFORE SWS SCALE\n");
-      
-      // Did we get a video frame?
-
-      // Convert the image from its native format to RGB
-      sws_scale(sws_ctx, 
-		(uint8_t const * const *)(pFrame->data),
-		pFrame->linesize,
-		0,
-		pCodecCtx->height,
-		pFrameRGB->data, 
-		pFrameRGB->linesize);
-      av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER SWS SCALE\n");
-      av_packet_unref(packet);
+    a->span_start[y] = av_clip(lrintf(r - half), 0, a->size);
+    a->span_end[y]   = av_clip(lrintf(r + half), a->span_start[y], a->size);
+    for (x = a->span_start[y]; x < a->span_end[y]; x++) {
+      float dx    = x + 0.5f - r;
+      float dz    = sqrtf(FFMAX(r * r - dx * dx - dy * dy, 0));
+      float light = FFMAX((-dx - dy + 1.4f * dz) / (1.99f * r), 0);
+      float c     = 0.25f + 0.75f * light;
 
+      put_color(a->ball + (y * a->size + x) * a->bpp, pix_fmt,
+                255 * c, 64 * c, 32 * c);
     }
   }
-  // create spff files
-  FILE *file;
+  return 0;
+}
+
+// box of the ball in a frame
+static void ball_position(const Animation *a, int n, int *x, int *y)
+{
+  int w     = a->background->width  - a->size;
+  int h     = a->background->height - a->size;
+  int speed = FFMAX(a->background->width / 100, 1);
+  int64_t t = n % BOUNCE_PERIOD;
+  int64_t pos;
+
+  // sideways at a constant speed, going back from the edges
+  pos = w ? (int64_t)n * speed % (2 * w) : 0;
+  *x  = pos > w ? 2 * w - pos : pos;
+
+  // up and down on a parabola, touching the bottom every period
+  *y = h - 4 * h * t * (BOUNCE_PERIOD - t) / (BOUNCE_PERIOD * BOUNCE_PERIOD);
+}
+
+static void restore_box(const Animation *a, AVFrame *canvas, int x, int y)
+{
+  const uint8_t *src = a->background->data[0] + y * a->background->linesize[0] + x * a->bpp;
+  uint8_t *dst = canvas->data[0] + y * canvas->linesize[0] + x * a->bpp;
+  int i;
+
+  for (i = 0; i < a->size; i++)
+    memcpy(dst + i * canvas->linesize[0], src + i * a->background->linesize[0],
+           a->size * a->bpp);
+}
+
+static void draw_ball(const Animation *a, AVFrame *canvas, int x, int y)
+{
+  uint8_t *dst = canvas->data[0] + y * canvas->linesize[0] + x * a->bpp;
+  int i;
+
+  for (i = 0; i < a->size; i++)
+    memcpy(dst + i * canvas->linesize[0] + a->span_start[i] * a->bpp,
+           a->ball + (i * a->size + a->span_start[i]) * a->bpp,
+           (a->span_end[i] - a->span_start[i]) * a->bpp);
+}
+
+// render, encode and write frame n, always as a keyframe in its own file
+static void render_frame(Worker *w, int n)
+{
+  Animation *a = w->a;
   char spfffilename[32];
-  AVCodec *spff_codec;
-  AVCodecContext *spff_context=NULL;
-  AVPacket spff_packet;
+  Job *job;
+  int x, y;
 
-  
+  snprintf(spfffilename, sizeof(spfffilename), "frame%03d.spff", n);
+  job = job_alloc(a->filename, spfffilename);
+  if (!job) {
+    av_log(NULL, AV_LOG_ERROR, "%s: %s\n", spfffilename, av_err2str(AVERROR(ENOMEM)));
+    w->b.nb_failed++;
+    return;
+  }
 
-  
-  // using example from https://github.com/aaronkchsu/FFMPEG-Bouncing-ball
-  //    /blob/master/bouncer/bouncer.c
-  // Find the codec for SPFF and allocate the context
+  // the canvas is shared with the background until the first frame, and
+  // with the encoder if it kept a reference to the last one
+  if ((job->ret = av_frame_make_writable(w->canvas)) >= 0) {
+    ball_position(a, n, &x, &y);
+    if (w->x >= 0)
+      restore_box(a, w->canvas, w->x, w->y);
+    draw_ball(a, w->canvas, x, y);
+    w->x = x;
+    w->y = y;
+    job->ret = av_frame_ref(job->frame, w->canvas);
+  }
+  if (job->ret >= 0)
+    job->ret = run_stage(&w->b, job, encode_image, STAT_ENCODE);
+  if (job->ret >= 0)
+    job->ret = run_stage(&w->b, job, write_image, STAT_WRITE);
+  job_finish(&w->b, &job);
+}
+
+static void *worker_thread(void *arg)
+{
+  Worker *w = arg;
+  int n;
 
+  while ((n = atomic_fetch_add(&w->a->next_frame, 1)) < w->a->nb_frames)
+    render_frame(w, n);
+  return NULL;
+}
 
-  spff_codec= avcodec_find_encoder(AV_CODEC_ID_SPFF);
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER FIND ENCODER\n");
-  spff_context = avcodec_alloc_context3(spff_codec);
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER GOT ENCODER CONTEXT\n");
+// render frame000.spff to the last frame over the picture
+static int animate(Bouncer *b, const char *filename)
+{
+  Animation a = { .filename = filename, .nb_frames = b->nb_frames };
+  Worker *workers = NULL;
+  Job *job;
+  int i, nb_workers, nb_started, ret;
 
-  // set context variables
-  spff_context->width=pCodecCtx->width;
-  spff_context->height=pCodecCtx->height;
-  spff_context->pix_fmt = spff_codec->pix_fmts[0];
-  spff_context->time_base=(AVRational){1,1};
-  av_log(spff_context,AV_LOG_INFO,"PRINT AFTER SETTING VARIABLES FOR ENCODER CONTEXT: width %d height %d pix_fmt %d\n",spff_context->width,spff_context->height,spff_context->pix_fmt);
-  av_log(spff_context,AV_LOG_INFO,"PRINT AFTER OPENED ENCODER %d\n",ret);
+  // the background is converted once, like a single picture
+  job = job_alloc(filename, "");
+  if (!job)
+    return AVERROR(ENOMEM);
+  if ((job->ret = run_stage(b, job, read_image, STAT_OPEN)) >= 0 &&
+      (job->ret = run_stage(b, job, decode_image, STAT_DECODE)) >= 0)
+    job->ret = run_stage(b, job, scale_image, STAT_SCALE);
+  if ((ret = job->ret) < 0) {
+    background_finish(b, &job);
+    return ret;
+  }
+  a.background = job->frame;
+  job->frame   = NULL;
+  background_finish(b, &job);
 
-  // open codec
-  ret = avcodec_open2(spff_context, spff_codec, NULL);
-
-  av_log(pCodecCtx,AV_LOG_INFO,"PRINT BEFORE GET CACHED CONTEXT format %d \n",av_get_pix_fmt_name(spff_context->pix_fmt));
-
-  sprintf(spfffilename,"frame%d.spff",100); //generate filename
-  file = fopen(spfffilename,"wb"); //create a file using the filename
-  
-  // prepare the AVframe to be written to file
-  
-  pFrameRGB->format= spff_context->pix_fmt;
-  pFrameRGB->width=pCodecCtx->width;
-  pFrameRGB->height=pCodecCtx->height;
-  // av_log(pFrameRGB,AV_LOG_INFO,"copy frame info: width %d, height %d", pFrameRGB->width, pFrameRGB->height);
-  // initialize spff packet to contain the frame
-  av_init_packet(&spff_packet);
-  spff_packet.data=NULL; // null for now, because it will be allocated later by the spff encoder
-  spff_packet.size=0; //0 for now, will be changed by encoder
-  av_log(spff_context,AV_LOG_INFO,"PRINT AFTER FINISHED WITH PACKET\n");
-
-  // encode the spff_frame in spff format
-  ret=avcodec_send_frame(spff_context, pFrameRGB);
-  av_log(pFormatCtx,AV_LOG_INFO,"PRINT AFTER SEND FRAME");
-  ret=avcodec_receive_packet(spff_context, &spff_packet);
-  av_log(spff_context,AV_LOG_INFO,"PRINT AFTER FINISHED ENCODING\n");
+  a.bpp  = b->pix_fmt == AV_PIX_FMT_RGB24 ? 3 : 1;
+  a.size = FFMAX(FFMIN(a.background->width, a.background->height) / 4, 1);
+  atomic_init(&a.next_frame, 0);
+  if ((ret = ball_init(&a, b->pix_fmt)) < 0)
+    goto end;
 
-  // write all bytes of spff_packet to file
-  fwrite(spff_packet.data, 1, spff_packet.size, file);
-  av_log(spff_context,AV_LOG_INFO,"PRINT AFTER WRITTING TO FILE\n");
+  nb_workers = FFMIN(av_cpu_count(), a.nb_frames);
+  workers    = av_mallocz_array(nb_workers, sizeof(*workers));
+  if (!workers) {
+    ret = AVERROR(ENOMEM);
+    goto end;
+  }
+  for (nb_started = 0; nb_started < nb_workers; nb_started++) {
+    Worker *w    = &workers[nb_started];
+    w->a         = &a;
+    w->b.pix_fmt = b->pix_fmt;
+    w->b.report  = b->report;
+    w->x         = -1;
+    w->canvas    = av_frame_clone(a.background);
+    if (!w->canvas) {
+      ret = AVERROR(ENOMEM);
+      break;
+    }
+    if ((ret = pthread_create(&w->thread, NULL, worker_thread, w))) {
+      av_frame_free(&w->canvas);
+      ret = AVERROR(ret);
+      break;
+    }
+  }
+  // the workers that did start render all the frames anyway
+  if (nb_started)
+    ret = 0;
 
-  // free memory
-  av_free (buffer);
-  av_free (pFrame);
-  av_free (pFrameRGB);
-  av_packet_unref(&spff_packet);
+  for (i = 0; i < nb_started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    b->nb_failed += workers[i].b.nb_failed;
+    av_frame_free(&workers[i].canvas);
+    bouncer_free(&workers[i].b);
+  }
 
-  // Close the codecs
-  avcodec_close(pCodecCtx);
-  avcodec_close(pCodecCtxOrig);
-  avcodec_close(spff_context);
+end:
+  av_freep(&workers);
+  av_freep(&a.ball);
+  av_freep(&a.span_start);
+  av_freep(&a.span_end);
+  av_frame_free(&a.background);
+  return ret;
+}
 
+// options come before the pictures, returns the index of the first one
+static int parse_options(Bouncer *b, int argc, char *argv[])
+{
+  int i;
 
-  // Close the files
-  avformat_close_input(&pFormatCtx);
-  fclose(file);
-  
-  return 0;
+  b->pix_fmt = AV_PIX_FMT_BGR8;
+  for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+    if (!strcmp(argv[i], "-pix_fmt") && i + 1 < argc) {
+      // bgr8 is what SPFF stores, rgb24 leaves the quantizing to the encoder
+      b->pix_fmt = av_get_pix_fmt(argv[++i]);
+      if (b->pix_fmt != AV_PIX_FMT_BGR8 && b->pix_fmt != AV_PIX_FMT_RGB8 &&
+          b->pix_fmt != AV_PIX_FMT_RGB24) {
+        av_log(NULL, AV_LOG_ERROR, "-pix_fmt must be bgr8, rgb8 or rgb24\n");
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "-frames") && i + 1 < argc) {
+      char *end;
+      long nb_frames = strtol(argv[++i], &end, 10);
+      if (*end || nb_frames <= 0 || nb_frames > 1000) {
+        av_log(NULL, AV_LOG_ERROR, "-frames must be between 1 and 1000\n");
+        return -1;
+      }
+      b->nb_frames = nb_frames;
+    } else if (!strcmp(argv[i], "-fast_open")) {
+      b->fast_open = 1;
+    } else if (!strcmp(argv[i], "-mmap")) {
+      b->mmap = 1;
+    } else if (!strcmp(argv[i], "-zero_copy")) {
+      b->zero_copy = 1;
+    } else if (!strcmp(argv[i], "-report") && i + 1 < argc) {
+      b->report_filename = argv[++i];
+    } else {
+      av_log(NULL, AV_LOG_ERROR, "unknown option %s\n", argv[i]);
+      return -1;
+    }
+  }
+  // only the raw 8-bit files are written without the encoder, and the
+  // frames of the animation go through it
+  if (b->zero_copy && (b->pix_fmt == AV_PIX_FMT_RGB24 || b->nb_frames)) {
+    av_log(NULL, AV_LOG_ERROR, "-zero_copy needs bgr8 or rgb8 and no -frames\n");
+    return -1;
+  }
+  return i;
+}
+
+/*
+ * bouncer [-pix_fmt bgr8|rgb8|rgb24] [-fast_open] [-mmap] [-zero_copy]
+ *         [-report report.json] picture.jpg
+ * converts a single picture into frame100.spff. Batch mode, with several
+ * files or directories, converts every .jpg into a .spff next to it while
+ * keeping the decoder, the encoder and the scalers open from one picture to
+ * the next. bouncer -frames N picture.jpg renders a ball bouncing over the
+ * picture into frame000.spff and the following frames. -report writes the
+ * time spent and the bytes produced by every step for every picture, with
+ * percentiles over the run, as JSON.
+ */
+int main(int argc, char *argv[]){
+  Bouncer b = { 0 };
+  Pipeline p = { 0 };
+  Report report = { 0 };
+  struct stat st;
+  int i, first, nb_errors = 0, ret = 0;
+
+  if ((first = parse_options(&b, argc, argv)) < 0)
+    return -1;
+  // confirm there is filename passed in
+  if (first == argc)
+    return -1;
+  // the animation has a single background
+  if (b.nb_frames && (first != argc - 1 || !is_jpg(argv[first])))
+    return -1;
+  // check file extension
+  if (first == argc - 1 && !is_jpg(argv[first]) &&
+      (stat(argv[first], &st) < 0 || !S_ISDIR(st.st_mode)))
+    return -1;
+
+  //register all codecs
+  av_register_all();
+
+  if (b.report_filename) {
+    if ((ret = report_open(&report, b.report_filename)) < 0) {
+      av_log(NULL, AV_LOG_ERROR, "%s: %s\n", b.report_filename, av_err2str(ret));
+      return -1;
+    }
+    b.report = &report;
+  }
+
+  if (b.nb_frames) {
+    b.verbose = 1;
+    if (animate(&b, argv[first]) < 0)
+      nb_errors++;
+  } else if (first == argc - 1 && is_jpg(argv[first])) {
+    // create spff files
+    b.verbose = 1;
+    if (convert_image(&b, argv[first], "frame100.spff") < 0)
+      nb_errors++;
+  } else if ((ret = pipeline_start(&p, &b)) < 0) {
+    av_log(NULL, AV_LOG_ERROR, "cannot start the pipeline: %s\n", av_err2str(ret));
+    nb_errors++;
+    pipeline_stop(&p);
+  } else {
+    for (i = first; i < argc; i++) {
+      ret = 0;
+      if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        ret = batch_add_dir(&p, argv[i]);
+      else if (is_jpg(argv[i]))
+        ret = batch_add(&p, argv[i]);
+      else
+        av_log(NULL, AV_LOG_WARNING, "%s: not a .jpg file, skipped\n", argv[i]);
+      if (ret < 0) {
+        av_log(NULL, AV_LOG_ERROR, "%s: %s\n", argv[i], av_err2str(ret));
+        nb_errors++;
+        if (ret == AVERROR(ENOMEM))
+          break;
+      }
+    }
+    pipeline_stop(&p);
+  }
+
+  report_close(&report);
+  bouncer_free(&b);
+  return b.nb_failed || nb_errors ? -1 : 0;
 }
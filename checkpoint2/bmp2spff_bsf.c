@@ -0,0 +1,240 @@
+/*
+ * CS 3505 Spring 2017
+ * BMP to SPFF bitstream filter
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * Rewrite 8-bit BMP files as SPFF files without decoding them. The raw or
+ * RLE8 coded rows stay where they are in the packet, the SPFF headers are
+ * written over the BMP ones and bfOffBits still points at the rows.
+ *
+ * Only the rewrite avoids copying the rows. bfOffBits of a BMP with a full
+ * palette is 1078, which is not 4-aligned, so the SPFF decoder copies these
+ * rows into its own frame instead of referencing the packet.
+ */
+
+#include "libavutil/intreadwrite.h"
+#include "avcodec.h"
+#include "bmp.h"
+#include "bsf.h"
+#include "bytestream.h"
+#include "spff.h"
+
+// BGR8 index of the color closest to a palette entry
+static uint8_t bmp2spff_color(uint32_t rgb)
+{
+    int r = rgb >> 16 & 0xFF;
+    int g = rgb >>  8 & 0xFF;
+    int b = rgb       & 0xFF;
+
+    return (b * 3 + 127) / 255 << 6 | (g * 7 + 127) / 255 << 3 |
+           (r * 7 + 127) / 255;
+}
+
+// translate the pixels of an RLE8 bitstream, leaving the opcodes alone
+static void bmp2spff_remap_rle8(uint8_t *buf, int size, const uint8_t *map)
+{
+    int pos = 0, i;
+
+    while (size - pos >= 2) {
+        int count = buf[pos];
+        int code  = buf[pos + 1];
+
+        pos += 2;
+        if (count) {
+            buf[pos - 1] = map[code];
+        } else if (code == 1) { // end of picture
+            break;
+        } else if (code == 2) { // delta
+            pos += 2;
+        } else if (code > 2) {  // absolute run, padded to 16 bits
+            code = FFMIN(code, size - pos);
+            for (i = 0; i < code; i++)
+                buf[pos + i] = map[buf[pos + i]];
+            pos += code + (code & 1);
+        }
+    }
+}
+
+// the headers are rewritten in place, copy the packet if it is shared
+static int bmp2spff_make_writable(AVPacket *pkt)
+{
+    AVPacket tmp;
+    int ret;
+
+    if (pkt->buf && av_buffer_is_writable(pkt->buf))
+        return 0;
+
+    if ((ret = av_new_packet(&tmp, pkt->size)) < 0)
+        return ret;
+    if ((ret = av_packet_copy_props(&tmp, pkt)) < 0) {
+        av_packet_unref(&tmp);
+        return ret;
+    }
+    memcpy(tmp.data, pkt->data, pkt->size);
+    av_packet_unref(pkt);
+    av_packet_move_ref(pkt, &tmp);
+
+    return 0;
+}
+
+static int bmp2spff_init(AVBSFContext *ctx)
+{
+    ctx->par_out->codec_id = AV_CODEC_ID_SPFF;
+    ctx->par_out->format   = AV_PIX_FMT_BGR8;
+    return 0;
+}
+
+static int bmp2spff_filter(AVBSFContext *ctx, AVPacket *out)
+{
+    AVPacket *in;
+    const uint8_t *buf;
+    uint8_t *ptr;
+    uint8_t map[256] = { 0 };
+    unsigned int hsize, ihsize, depth;
+    BiCompression comp = BMP_RGB;
+    int width, height, planes;
+    int colors = 256, identity = 1;
+    int i, ret;
+
+    ret = ff_bsf_get_packet(ctx, &in);
+    if (ret < 0)
+        return ret;
+
+    if (in->size < 14 + 12 || AV_RB16(in->data) != (('B' << 8) | 'M')) {
+        av_log(ctx, AV_LOG_ERROR, "not a BMP file\n");
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    buf    = in->data + 10;
+    hsize  = bytestream_get_le32(&buf); /* header size */
+    ihsize = bytestream_get_le32(&buf); /* more header size */
+    if (ihsize + 14LL > hsize || hsize >= in->size) {
+        av_log(ctx, AV_LOG_ERROR, "invalid header size %u\n", hsize);
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    switch (ihsize) {
+    case  40: // windib
+    case  56: // windib v3
+    case  64: // OS/2 v2
+    case 108: // windib v4
+    case 124: // windib v5
+        width  = bytestream_get_le32(&buf);
+        height = bytestream_get_le32(&buf);
+        break;
+    case  12: // OS/2 v1
+        width  = bytestream_get_le16(&buf);
+        height = bytestream_get_le16(&buf);
+        break;
+    default:
+        av_log(ctx, AV_LOG_ERROR, "unsupported BMP file, patch welcome\n");
+        ret = AVERROR_PATCHWELCOME;
+        goto fail;
+    }
+    planes = bytestream_get_le16(&buf);
+    depth  = bytestream_get_le16(&buf);
+    if (ihsize >= 40)
+        comp = bytestream_get_le32(&buf);
+
+    if (planes != 1 || depth != 8 || (comp != BMP_RGB && comp != BMP_RLE8)) {
+        av_log(ctx, AV_LOG_ERROR,
+               "only 8-bit raw or RLE8 BMP files can be converted\n");
+        ret = AVERROR_PATCHWELCOME;
+        goto fail;
+    }
+    if (width <= 0 || height == INT_MIN || (comp == BMP_RLE8 && height < 0)) {
+        av_log(ctx, AV_LOG_ERROR, "invalid size %dx%d\n", width, height);
+        ret = AVERROR_INVALIDDATA;
+        goto fail;
+    }
+
+    // palette to BGR8, same rules as the BMP decoder
+    if (ihsize >= 36) {
+        unsigned int t = AV_RL32(in->data + 46);
+        if (t && t <= 256)
+            colors = t;
+    } else {
+        colors = FFMIN(256, (hsize - ihsize - 14) / 3);
+    }
+    buf = in->data + 14 + ihsize;
+    if (hsize - ihsize - 14 < colors * 4) {
+        // OS/2 bitmap, 3 bytes per palette entry
+        if (hsize - ihsize - 14 < colors * 3) {
+            av_log(ctx, AV_LOG_ERROR, "palette doesn't fit in packet\n");
+            ret = AVERROR_INVALIDDATA;
+            goto fail;
+        }
+        for (i = 0; i < colors; i++)
+            map[i] = bmp2spff_color(bytestream_get_le24(&buf));
+    } else {
+        for (i = 0; i < colors; i++)
+            map[i] = bmp2spff_color(bytestream_get_le32(&buf));
+    }
+    for (i = 0; i < colors; i++)
+        identity &= map[i] == i;
+
+    if ((ret = bmp2spff_make_writable(in)) < 0)
+        goto fail;
+
+    // bfOffBits is kept, the palette left in between is ignored
+    ptr = in->data;
+    bytestream_put_byte(&ptr, 'S');
+    bytestream_put_byte(&ptr, 'F');
+    bytestream_put_le32(&ptr, in->size);
+    bytestream_put_le32(&ptr, hsize);
+    bytestream_put_le32(&ptr, comp == BMP_RLE8 ? SIZE_SPFFINFOHEADER_V2
+                                               : SIZE_SPFFINFOHEADER);
+    bytestream_put_le32(&ptr, width);
+    bytestream_put_le32(&ptr, height);
+    bytestream_put_le16(&ptr, 1);
+    bytestream_put_le16(&ptr, 8);
+    if (comp == BMP_RLE8)
+        bytestream_put_le32(&ptr, SPFF_RLE8);
+
+    // rows of pictures already using the BGR8 palette are left untouched
+    if (!identity) {
+        if (comp == BMP_RLE8) {
+            bmp2spff_remap_rle8(in->data + hsize, in->size - hsize, map);
+        } else {
+            for (ptr = in->data + hsize; ptr < in->data + in->size; ptr++)
+                *ptr = map[*ptr];
+        }
+    }
+
+    av_packet_move_ref(out, in);
+fail:
+    av_packet_free(&in);
+    return ret;
+}
+
+static const enum AVCodecID codec_ids[] = {
+    AV_CODEC_ID_BMP, AV_CODEC_ID_NONE,
+};
+
+const AVBitStreamFilter ff_bmp2spff_bsf = {
+    .name      = "bmp2spff",
+    .init      = bmp2spff_init,
+    .filter    = bmp2spff_filter,
+    .codec_ids = codec_ids,
+};
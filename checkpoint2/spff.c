@@ -0,0 +1,131 @@
+/*
+ * CS 3505 Spring 2017
+ * SPFF stripe checksums
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include "config.h"
+
+#include "libavutil/attributes.h"
+#include "libavutil/cpu.h"
+#include "libavutil/intreadwrite.h"
+#include "avcodec.h"
+#include "spff.h"
+
+// CRC-32C polynomial, bit reversed for the least significant bit first tables
+#define CRC32C_POLY 0x82F63B78
+
+static uint32_t crc32c_c(const AVCRC *table, uint32_t crc,
+                         const uint8_t *buf, size_t len)
+{
+    return av_crc(table, crc, buf, len);
+}
+
+#if HAVE_SSE42_INLINE
+// the crc32 instruction of SSE4.2 computes CRC-32C, 8 bytes at a time
+static uint32_t crc32c_sse42(const AVCRC *table, uint32_t crc,
+                             const uint8_t *buf, size_t len)
+{
+#if ARCH_X86_64
+    uint64_t crc64 = crc;
+
+    for (; len >= 8; len -= 8, buf += 8)
+        __asm__ ("crc32q %1, %0" : "+r"(crc64) : "rm"(AV_RN64(buf)));
+    crc = crc64;
+#endif
+    for (; len >= 4; len -= 4, buf += 4)
+        __asm__ ("crc32l %1, %0" : "+r"(crc) : "rm"(AV_RN32(buf)));
+    for (; len; len--, buf++)
+        __asm__ ("crc32b %1, %0" : "+r"(crc) : "qm"(*buf));
+    return crc;
+}
+#endif
+
+av_cold void ff_spff_crc_init(SPFFCRCContext *c)
+{
+    c->crc32c = crc32c_c;
+#if HAVE_SSE42_INLINE
+    if (av_get_cpu_flags() & AV_CPU_FLAG_SSE42) {
+        c->crc32c = crc32c_sse42;
+        return;
+    }
+#endif
+    av_crc_init(c->table, 1, 32, CRC32C_POLY, sizeof(c->table));
+}
+
+void ff_spff_downscale(uint8_t *dst, int dst_linesize,
+                       const uint8_t *src, int src_linesize,
+                       int w, int h, enum AVPixelFormat pix_fmt)
+{
+    static const uint8_t shift[2][3] = { { 0, 3, 6 }, { 0, 2, 5 } };
+    static const uint8_t mask[2][3]  = { { 7, 7, 3 }, { 3, 7, 7 } };
+    int fmt = pix_fmt == AV_PIX_FMT_RGB8;
+    int bpp = pix_fmt == AV_PIX_FMT_BGR24 ? 3 :
+              pix_fmt == AV_PIX_FMT_BGRA  ? 4 : 1;
+    int x, y, i;
+
+    for (y = 0; y < h; y += 2) {
+        const uint8_t *row0 = src + y * src_linesize;
+        const uint8_t *row1 = y + 1 < h ? row0 + src_linesize : row0;
+
+        for (x = 0; x < w; x += 2) {
+            int x1 = FFMIN(x + 1, w - 1);
+            int v  = 0;
+
+            if (bpp > 1) {
+                const uint8_t *a = row0 + x * bpp, *b = row0 + x1 * bpp;
+                const uint8_t *c = row1 + x * bpp, *d = row1 + x1 * bpp;
+
+                for (i = 0; i < bpp; i++)
+                    dst[(x >> 1) * bpp + i] = (a[i] + b[i] + c[i] + d[i] + 2) >> 2;
+                continue;
+            }
+            for (i = 0; i < 3; i++) {
+                int s = shift[fmt][i], m = mask[fmt][i];
+                int sum = (row0[x] >> s & m) + (row0[x1] >> s & m) +
+                          (row1[x] >> s & m) + (row1[x1] >> s & m);
+                v |= (sum + 2) >> 2 << s;
+            }
+            dst[x >> 1] = v;
+        }
+        dst += dst_linesize;
+    }
+}
+
+int ff_spff_checksum_stripe(AVCodecContext *avctx, void *arg,
+                            int jobnr, int threadnr)
+{
+    const SPFFChecksumData *cd = arg;
+    unsigned int start, end;
+    uint32_t crc;
+
+    if (cd->offsets) {
+        start = AV_RL32(cd->offsets + 4 * jobnr);
+        end   = AV_RL32(cd->offsets + 4 * jobnr + 4);
+    } else {
+        start = jobnr * cd->stripe_size;
+        end   = jobnr == cd->nb_stripes - 1 ? cd->size : start + cd->stripe_size;
+    }
+    if (start > end || end > cd->size)
+        return AVERROR_INVALIDDATA;
+
+    crc = cd->c->crc32c(cd->c->table, UINT32_MAX, cd->data + start, end - start);
+    AV_WL32(cd->crcs + 4 * jobnr, crc ^ UINT32_MAX);
+    return 0;
+}
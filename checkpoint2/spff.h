@@ -0,0 +1,115 @@
+/*
+ * CS 3505 Spring 2017
+ * SPFF image format common definitions
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVCODEC_SPFF_H
+#define AVCODEC_SPFF_H
+
+#include "libavutil/crc.h"
+#include "avcodec.h"
+
+// STRUCTURE.field refer to the MSVC documentation for BITMAPFILEHEADER
+// and related pages, SPFF headers follow the same pattern.
+#define SIZE_SPFFFILEHEADER    10
+#define SIZE_SPFFINFOHEADER    16
+#define SIZE_SPFFINFOHEADER_V2 20 // adds biCompression
+#define SIZE_SPFFINFOHEADER_V3 24 // adds biStripeHeight
+#define SIZE_SPFFINFOHEADER_V4 28 // adds biTileWidth
+/* adds biLevels and biLevelOffset[3], up to three raw copies of the picture
+ * halved again each time, stored at the given offsets from bfOffBits with
+ * the row order and padding of the picture */
+#define SIZE_SPFFINFOHEADER_V5 44
+/* adds biChecksums, the number of le32 CRC-32C values following the stripe
+ * table. Tiles and deflate stripes have one per stripe table entry, raw
+ * pictures one per biStripeHeight rows and the other codings a single one.
+ * They cover the picture only, up to the first level if there are any. */
+#define SIZE_SPFFINFOHEADER_V6 48
+
+/* 24 and 32-bit pictures are stored as BGR24 and BGRA, raw only. Their rows
+ * are padded to this many bytes and so are the headers, so the rows of a
+ * buffer allocated by av_malloc() start on a cache line and can be used in
+ * place by SIMD code. */
+#define SPFF_TRUECOLOR_ALIGN 64
+
+// size of a stored row, padding included
+static inline int ff_spff_row_size(int width, int bit_count)
+{
+    int size = width * bit_count >> 3;
+    return FFALIGN(size, bit_count > 8 ? SPFF_TRUECOLOR_ALIGN : 4);
+}
+
+typedef enum {
+    /* With a biTileWidth, raw and deflate pictures are cut into tiles of
+     * biTileWidth x biStripeHeight, stored one tile row after the other in
+     * file row order, with unpadded rows. The stripe table then has an
+     * entry per tile, raw tiles included. */
+    SPFF_RGB  = 0,
+    SPFF_RLE8 = 1, // same bitstream as BMP RLE8
+    /* Stripes of biStripeHeight rows deflated independently. The info
+     * header is followed by a table of nb_stripes + 1 le32 offsets of the
+     * stripes relative to bfOffBits, the last one being the data size. */
+    SPFF_DEFLATE = 2,
+    /* Inter frame, only valid after another frame of the same size. The
+     * data is a le32 count of rectangles, each one given as le32 x, y,
+     * width, height (y counted from the top whatever the row order) and
+     * followed by its pixels, top row first and without padding. Pixels
+     * outside the rectangles are the ones of the previous frame. */
+    SPFF_DELTA = 3,
+} SPFFCompression;
+
+typedef struct SPFFCRCContext {
+    uint32_t (*crc32c)(const AVCRC *table, uint32_t crc,
+                       const uint8_t *buf, size_t len);
+    AVCRC table[1024]; // only for the C version
+} SPFFCRCContext;
+
+/*
+ * Stripes to checksum. Stripe i covers the bytes between the le32 values
+ * offsets[i] and offsets[i + 1] when there is a stripe table, otherwise
+ * stripe_size bytes from i * stripe_size, the last one ending at size.
+ */
+typedef struct SPFFChecksumData {
+    const SPFFCRCContext *c;
+    const uint8_t *data;
+    unsigned int size;
+    const uint8_t *offsets;
+    unsigned int stripe_size;
+    int nb_stripes;
+    uint8_t *crcs; // le32 results
+} SPFFChecksumData;
+
+void ff_spff_crc_init(SPFFCRCContext *c);
+
+/**
+ * Halve a picture with a 2x2 box filter, the last column and row being
+ * repeated for odd sizes. 3-3-2 pictures are filtered one colour at a time,
+ * the other formats one byte at a time. dst may be src, with the same
+ * linesize.
+ */
+void ff_spff_downscale(uint8_t *dst, int dst_linesize,
+                       const uint8_t *src, int src_linesize,
+                       int w, int h, enum AVPixelFormat pix_fmt);
+
+// execute2() job writing the checksum of stripe jobnr
+int ff_spff_checksum_stripe(AVCodecContext *avctx, void *arg,
+                            int jobnr, int threadnr);
+
+#endif /* AVCODEC_SPFF_H */
@@ -0,0 +1,150 @@
+/*
+ * CS 3505 Spring 2017
+ * SPFF parser
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * SPFF parser, splits concatenated SPFF files using bfSize
+ */
+
+#include <string.h>
+
+#include "libavutil/bswap.h"
+#include "libavutil/intreadwrite.h"
+
+#include "parser.h"
+#include "spff.h"
+
+#define SPFF_MAGIC (('S' << 8) | 'F')
+
+typedef struct SPFFParseContext {
+    ParseContext pc;
+    uint32_t fsize; // bfSize of the current file, 0 until read
+    uint32_t pos;   // bytes of the current file seen so far
+} SPFFParseContext;
+
+// fill in what the headers tell about a complete file
+static void spff_parse_header(AVCodecParserContext *s,
+                              const uint8_t *buf, int buf_size)
+{
+    int height;
+    unsigned int ihsize;
+    SPFFCompression comp = SPFF_RGB;
+
+    if (buf_size < SIZE_SPFFFILEHEADER + SIZE_SPFFINFOHEADER)
+        return;
+
+    ihsize = AV_RL32(buf + 10);
+    height = AV_RL32(buf + 18);
+    // has no absolute value, the decoder rejects such files anyway
+    if (height == INT_MIN)
+        return;
+    if (ihsize >= SIZE_SPFFINFOHEADER_V2 &&
+        buf_size >= SIZE_SPFFFILEHEADER + SIZE_SPFFINFOHEADER_V2)
+        comp = AV_RL32(buf + 26);
+
+    s->width        = AV_RL32(buf + 14);
+    s->height       = FFABS(height);
+    s->coded_width  = s->width;
+    s->coded_height = s->height;
+    switch (AV_RL16(buf + 24)) {
+    case 24: s->format = AV_PIX_FMT_BGR24; break;
+    case 32: s->format = AV_PIX_FMT_BGRA;  break;
+    default: s->format = AV_PIX_FMT_BGR8;  break;
+    }
+    s->key_frame    = comp != SPFF_DELTA;
+    s->pict_type    = s->key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_P;
+}
+
+static int spff_parse(AVCodecParserContext *s, AVCodecContext *avctx,
+                      const uint8_t **poutbuf, int *poutbuf_size,
+                      const uint8_t *buf, int buf_size)
+{
+    SPFFParseContext *ppc = s->priv_data;
+    uint64_t state        = ppc->pc.state64;
+    int next = END_NOT_FOUND;
+    int i = 0;
+
+    *poutbuf_size = 0;
+
+    if (s->flags & PARSER_FLAG_COMPLETE_FRAMES) {
+        next = buf_size;
+    } else {
+        while (i < buf_size) {
+            if (!ppc->fsize) {
+                // look for 'SF' followed by the le32 file size
+                state = (state << 8) | buf[i++];
+                if (++ppc->pos < 6 || (state >> 32 & 0xFFFF) != SPFF_MAGIC ||
+                    av_bswap32(state) < SIZE_SPFFFILEHEADER + SIZE_SPFFINFOHEADER)
+                    continue;
+                if (ppc->pos > 6) {
+                    // drop whatever came before the header, either from the
+                    // bytes buffered so far or by not consuming it
+                    int junk = ppc->pos - 6;
+                    if (junk >= ppc->pc.index) {
+                        ppc->pc.index = 0;
+                        if (i > 6) {
+                            ppc->pc.state64 = 0;
+                            ppc->pos        = 0;
+                            *poutbuf        = NULL;
+                            return i - 6;
+                        }
+                    } else {
+                        memmove(ppc->pc.buffer, ppc->pc.buffer + junk,
+                                ppc->pc.index - junk);
+                        ppc->pc.index -= junk;
+                    }
+                }
+                ppc->fsize = av_bswap32(state);
+                ppc->pos   = 6;
+            } else {
+                // nothing to look at until the end of the file
+                uint32_t skip = FFMIN(ppc->fsize - ppc->pos, buf_size - i);
+                i        += skip;
+                ppc->pos += skip;
+                if (ppc->pos == ppc->fsize) {
+                    next       = i;
+                    ppc->fsize = 0;
+                    ppc->pos   = 0;
+                    state      = 0;
+                    break;
+                }
+            }
+        }
+        ppc->pc.state64 = state;
+
+        if (ff_combine_frame(&ppc->pc, next, &buf, &buf_size) < 0)
+            return buf_size;
+    }
+
+    spff_parse_header(s, buf, buf_size);
+
+    *poutbuf      = buf;
+    *poutbuf_size = buf_size;
+    return next;
+}
+
+AVCodecParser ff_spff_parser = {
+    .codec_ids      = { AV_CODEC_ID_SPFF },
+    .priv_data_size = sizeof(SPFFParseContext),
+    .parser_parse   = spff_parse,
+    .parser_close   = ff_parse_close,
+};
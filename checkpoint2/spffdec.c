@@ -24,28 +24,462 @@
 
 #include <inttypes.h>
 
+#include "config.h"
+
+#if CONFIG_ZLIB
+#include <zlib.h>
+#endif
+
+#include "libavutil/imgutils.h"
+#include "libavutil/opt.h"
 #include "avcodec.h"
 #include "bytestream.h"
 #include "internal.h"
-#include "msrledec.h"
+#include "spff.h"
+#include "thread.h"
 
-static int spff_decode_frame(AVCodecContext *avctx,
-                            void *data, int *got_frame,
-                            AVPacket *avpkt)
+typedef struct SPFFDecContext {
+    const AVClass *class;
+    AVBufferRef *palette; // systematic BGR8 palette shared by zero-copy frames
+    int zero_copy;
+    int crop_x, crop_y, crop_w, crop_h; // window to decode, 0 size for the rest
+    uint8_t *crop_buf; // whole RLE8 picture when only a window is wanted
+    unsigned int crop_buf_size;
+    ThreadFrame picture;      // frame being decoded
+    ThreadFrame last_picture; // reference of inter frames
+#if CONFIG_ZLIB
+    z_stream *zstream; // one per slice thread
+    int nb_zstreams;
+    uint8_t *row_buf;  // one row per slice thread, for rows outside the window
+    unsigned int row_buf_size;
+#endif
+    int *tile_ret;
+    unsigned int tile_ret_size;
+    SPFFCRCContext crc;
+    uint8_t *crc_buf;  // checksums of the stripes as decoded
+    unsigned int crc_buf_size;
+    int corrupt;       // the picture failed its checksums
+    int lowres_shift;  // halvings left for lowres after decoding the picture
+    // AV_CODEC_FLAG_TRUNCATED input, files may span several packets
+    uint8_t *stream_buf; // headers, or the whole file if it is not streamed
+    unsigned int stream_buf_size;
+    int stream_state;
+    unsigned int stream_fsize, stream_hsize;
+    unsigned int stream_pos; // bytes of the current file consumed
+    int stream_n;            // row size in the file
+    int stream_top_down;
+    int stream_rows;         // rows complete, in file order
+    int stream_rows_drawn;   // rows already passed to draw_horiz_band
+} SPFFDecContext;
+
+enum SPFFStreamState {
+    SPFF_STREAM_HEADER, // gathering the headers
+    SPFF_STREAM_ROWS,   // raw rows copied to the frame as they arrive
+    SPFF_STREAM_FILE,   // gathering the whole file to decode it at once
+    SPFF_STREAM_SKIP,   // frame done, skipping to the end of the file
+};
+
+/*
+ * Rows handed to the slice threads. Only the window x, y0, width, height
+ * is decoded, y0 being a file row, and dst points at the frame row of y0.
+ * x and width are in bytes, which only differs from pixels for truecolor.
+ */
+typedef struct SPFFSliceData {
+    const uint8_t *src;
+    uint8_t *dst;
+    int linesize;   // frame linesize, negative for bottom-up files
+    int n;          // padded row size in the file
+    int x, y0;
+    int width, height;
+    int nb_slices;
+    // tiles, deflate stripes being tiles as wide as the picture
+    SPFFCompression comp;
+    int tiled;      // tile rows are unpadded
+    int picture_width, picture_height;
+    int tile_width, tile_height;
+    int nb_tiles_x;
+    int tx0, ty0, ntx; // tiles crossing the window
+    unsigned int dsize;
+    const uint8_t *tile_offsets; // le32 table from the header
+} SPFFSliceData;
+
+/*
+ * Make the frame point straight at the rows stored in the packet.
+ * SPFF rows are already padded to 4 bytes, 64 for truecolor, so the packet
+ * payload can be used as the frame data, with a negative linesize for
+ * bottom-up files.
+ */
+static int spff_ref_packet(AVCodecContext *avctx, AVFrame *p,
+                           AVPacket *avpkt, const uint8_t *buf, int n,
+                           int top_down)
+{
+    SPFFDecContext *s = avctx->priv_data;
+    int pal = avctx->pix_fmt == AV_PIX_FMT_BGR8;
+    int ret;
+
+    // BGR8 is pseudo-paletted, frames must carry the palette in data[1]
+    if (pal && !s->palette) {
+        s->palette = av_buffer_alloc(AVPALETTE_SIZE);
+        if (!s->palette)
+            return AVERROR(ENOMEM);
+        avpriv_set_systematic_pal4((uint32_t *)s->palette->data, avctx->pix_fmt);
+    }
+
+    if ((ret = ff_decode_frame_props(avctx, p)) < 0)
+        return ret;
+
+    p->buf[0] = av_buffer_ref(avpkt->buf);
+    if (pal)
+        p->buf[1] = av_buffer_ref(s->palette);
+    if (!p->buf[0] || (pal && !p->buf[1])) {
+        av_buffer_unref(&p->buf[0]);
+        av_buffer_unref(&p->buf[1]);
+        return AVERROR(ENOMEM);
+    }
+
+    p->width         = avctx->width;
+    p->height        = avctx->height;
+    p->format        = avctx->pix_fmt;
+    if (top_down) {
+        p->data[0]     = (uint8_t *)buf;
+        p->linesize[0] = n;
+    } else {
+        p->data[0]     = (uint8_t *)buf + (avctx->height - 1) * n;
+        p->linesize[0] = -n;
+    }
+    if (pal) {
+        p->data[1]     = s->palette->data;
+        p->linesize[1] = 4;
+    }
+    p->extended_data = p->data;
+
+    return 0;
+}
+
+static int spff_decode_slice(AVCodecContext *avctx, void *arg,
+                             int jobnr, int threadnr)
+{
+    const SPFFSliceData *td = arg;
+    int start = (td->height *  jobnr     ) / td->nb_slices;
+    int end   = (td->height * (jobnr + 1)) / td->nb_slices;
+    const uint8_t *buf = td->src + (td->y0 + start) * td->n + td->x;
+    uint8_t *ptr       = td->dst + start * td->linesize;
+    int i;
+
+    if (!td->x && td->linesize == td->n) {
+        // the frame has the same layout as the file, copy the band in one go
+        memcpy(ptr, buf, td->n * (end - start));
+        return 0;
+    }
+
+    for (i = start; i < end; i++) {
+        // copies count bytes from the object pointed to by src to the object
+        // pointed to by dest. memcpy(destination, source, count bytes)
+        memcpy(ptr, buf, td->width);
+        //move pointers
+        buf += td->n;
+        ptr += td->linesize;
+    }
+
+    return 0;
+}
+
+// decode the part of one tile that is inside the window
+static int spff_decode_tile(AVCodecContext *avctx, void *arg,
+                            int jobnr, int threadnr)
+{
+    const SPFFSliceData *td = arg;
+    int tx              = td->tx0 + jobnr % td->ntx;
+    int ty              = td->ty0 + jobnr / td->ntx;
+    int tile            = ty * td->nb_tiles_x + tx;
+    unsigned int offset = AV_RL32(td->tile_offsets + 4 *  tile);
+    unsigned int next   = AV_RL32(td->tile_offsets + 4 * (tile + 1));
+    int x0      = tx * td->tile_width;
+    int w       = FFMIN(td->tile_width, td->picture_width - x0);
+    int start   = ty * td->tile_height;
+    int end     = FFMIN(start + td->tile_height, td->picture_height);
+    int stride  = td->tiled ? w : td->n;
+    int x       = FFMAX(x0, td->x);
+    int width   = FFMIN(x0 + w, td->x + td->width) - x;
+    int y       = FFMAX(start, td->y0);
+    int y_end   = FFMIN(end, td->y0 + td->height);
+    uint8_t *ptr = td->dst + (y - td->y0) * td->linesize + x - td->x;
+    int i;
+
+    if (offset > next || next > td->dsize) {
+        av_log(avctx, AV_LOG_ERROR, "invalid offset for tile %d\n", tile);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (td->comp == SPFF_RGB) {
+        const uint8_t *buf = td->src + offset + (y - start) * stride + x - x0;
+
+        if (next - offset < (end - start) * (int64_t)stride) {
+            av_log(avctx, AV_LOG_ERROR, "tile %d is truncated\n", tile);
+            return AVERROR_INVALIDDATA;
+        }
+        for (i = y; i < y_end; i++) {
+            memcpy(ptr, buf, width);
+            buf += stride;
+            ptr += td->linesize;
+        }
+        return 0;
+    }
+
+#if CONFIG_ZLIB
+    {
+        SPFFDecContext *s = avctx->priv_data;
+        z_stream *zstream = &s->zstream[threadnr];
+        uint8_t *row      = s->row_buf + threadnr * td->n;
+        int ret;
+
+        inflateReset(zstream);
+        zstream->next_in  = (uint8_t *)td->src + offset;
+        zstream->avail_in = next - offset;
+
+        // rows above the window still have to go through the inflater
+        for (i = start; i < y_end; i++) {
+            uint8_t *out = i >= y && width == w ? ptr : row;
+
+            // inflate straight into the frame when the row is wanted whole,
+            // the rest, row padding included, goes to a scratch row
+            zstream->next_out  = out;
+            zstream->avail_out = w;
+            ret = inflate(zstream, Z_SYNC_FLUSH);
+            if (stride > w && ret == Z_OK && !zstream->avail_out) {
+                zstream->next_out  = row + w;
+                zstream->avail_out = stride - w;
+                ret = inflate(zstream, Z_SYNC_FLUSH);
+            }
+            if ((ret != Z_OK && ret != Z_STREAM_END) || zstream->avail_out) {
+                av_log(avctx, AV_LOG_ERROR, "tile %d is truncated at row %d\n",
+                       tile, i);
+                return AVERROR_INVALIDDATA;
+            }
+            if (i >= y) {
+                if (out == row)
+                    memcpy(ptr, row + x - x0, width);
+                ptr += td->linesize;
+            }
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/*
+ * Decode RLE8 data, the bitstream is the one BMP uses (see msrledec.c),
+ * but runs are expanded with memset and the row order follows the file.
+ */
+static int spff_rle8_decode(AVCodecContext *avctx, uint8_t *ptr, int linesize,
+                            int width, int height, GetByteContext *gb)
+{
+    uint8_t *row = ptr;
+    int x = 0, y = 0;
+
+    while (bytestream2_get_bytes_left(gb) >= 2) {
+        int count = bytestream2_get_byteu(gb);
+        int code  = bytestream2_get_byteu(gb);
+
+        if (count) {
+            // encoded mode: one colour repeated count times
+            if (count > width - x) {
+                av_log(avctx, AV_LOG_ERROR, "run overflows row %d\n", y);
+                return AVERROR_INVALIDDATA;
+            }
+            memset(row + x, code, count);
+            x += count;
+            continue;
+        }
+
+        switch (code) {
+        case 0: // end of line
+            x = 0;
+            if (++y >= height)
+                return 0;
+            row += linesize;
+            break;
+        case 1: // end of picture
+            return 0;
+        case 2: { // delta
+            int dx = bytestream2_get_byte(gb);
+            int dy = bytestream2_get_byte(gb);
+            if (x + dx > width || y + dy >= height) {
+                av_log(avctx, AV_LOG_ERROR, "delta moves outside the picture\n");
+                return AVERROR_INVALIDDATA;
+            }
+            x   += dx;
+            y   += dy;
+            row += dy * linesize;
+            break;
+        }
+        default: // absolute mode, copy code pixels, padded to 16 bits
+            if (code > width - x ||
+                code > bytestream2_get_bytes_left(gb)) {
+                av_log(avctx, AV_LOG_ERROR, "literal run overflows row %d\n", y);
+                return AVERROR_INVALIDDATA;
+            }
+            bytestream2_get_bufferu(gb, row + x, code);
+            bytestream2_skip(gb, code & 1);
+            x += code;
+            break;
+        }
+    }
+
+    av_log(avctx, AV_LOG_WARNING, "RLE8 data ended before end of picture\n");
+    return 0;
+}
+
+/*
+ * Decode an inter frame, the rectangles are drawn over a copy of the
+ * previous frame. Only their part inside the window x, y is kept.
+ */
+static int spff_decode_delta(AVCodecContext *avctx, AVFrame *p,
+                             const AVFrame *ref, GetByteContext *gb,
+                             int width, int height, int x0, int y0)
 {
+    unsigned int nb_rects, i;
+
+    av_image_copy_plane(p->data[0], p->linesize[0],
+                        ref->data[0], ref->linesize[0],
+                        avctx->width, avctx->height);
+
+    nb_rects = bytestream2_get_le32(gb);
+    for (i = 0; i < nb_rects; i++) {
+        unsigned int x, y, w, h;
+        int left, right, top, bottom, j;
+        uint8_t *ptr;
+
+        if (bytestream2_get_bytes_left(gb) < 16) {
+            av_log(avctx, AV_LOG_ERROR, "missing rectangle %u\n", i);
+            return AVERROR_INVALIDDATA;
+        }
+        x = bytestream2_get_le32u(gb);
+        y = bytestream2_get_le32u(gb);
+        w = bytestream2_get_le32u(gb);
+        h = bytestream2_get_le32u(gb);
+        if (x > width  || w > width  - x ||
+            y > height || h > height - y) {
+            av_log(avctx, AV_LOG_ERROR, "rectangle %u is outside the picture\n", i);
+            return AVERROR_INVALIDDATA;
+        }
+        if ((int64_t)w * h > bytestream2_get_bytes_left(gb)) {
+            av_log(avctx, AV_LOG_ERROR, "rectangle %u is truncated\n", i);
+            return AVERROR_INVALIDDATA;
+        }
+
+        left   = FFMAX(x, x0);
+        right  = FFMIN(x + w, x0 + avctx->width);
+        top    = FFMAX(y, y0);
+        bottom = FFMIN(y + h, y0 + avctx->height);
+        if (left >= right || top >= bottom) {
+            bytestream2_skipu(gb, w * h);
+            continue;
+        }
+
+        bytestream2_skipu(gb, (top - y) * w);
+        ptr = p->data[0] + (top - y0) * p->linesize[0] + left - x0;
+        for (j = top; j < bottom; j++) {
+            memcpy(ptr, gb->buffer + left - x, right - left);
+            bytestream2_skipu(gb, w);
+            ptr += p->linesize[0];
+        }
+        bytestream2_skipu(gb, (y + h - bottom) * w);
+    }
+
+    return 0;
+}
+
+/*
+ * Check the stripe checksums of a picture, dsize being the data up to the
+ * first level or the end of the file. Mismatches are errors with
+ * AV_EF_EXPLODE, otherwise the frame is only flagged as corrupt.
+ */
+static int spff_verify_checksums(AVCodecContext *avctx, const uint8_t *buf0,
+                                 unsigned int hsize, unsigned int ihsize,
+                                 unsigned int nb_crcs, SPFFCompression comp,
+                                 unsigned int stripe_height,
+                                 unsigned int tile_width,
+                                 int width, int height, int bit_count,
+                                 unsigned int dsize)
+{
+    SPFFDecContext *s = avctx->priv_data;
+    int64_t crcs_pos  = SIZE_SPFFFILEHEADER + ihsize;
+    SPFFChecksumData cd = { 0 };
+    const uint8_t *crcs;
+    int64_t nb_stripes;
+    int i, bad = 0;
+
+    stripe_height = FFMIN(stripe_height, height);
+    if (comp == SPFF_DEFLATE || tile_width) {
+        if (!tile_width || tile_width > width)
+            tile_width = width;
+        nb_stripes = (int64_t)((width + tile_width - 1) / tile_width) *
+                     ((height + stripe_height - 1) / stripe_height);
+        cd.offsets = buf0 + crcs_pos;
+        crcs_pos  += (nb_stripes + 1) * 4;
+    } else if (comp == SPFF_RGB && stripe_height) {
+        nb_stripes     = (height + stripe_height - 1) / stripe_height;
+        cd.stripe_size = stripe_height * ff_spff_row_size(width, bit_count);
+    } else {
+        nb_stripes     = 1;
+        cd.stripe_size = dsize;
+    }
+    if (nb_crcs != nb_stripes || crcs_pos + nb_crcs * 4LL > hsize) {
+        av_log(avctx, AV_LOG_ERROR, "invalid number of checksums %u\n", nb_crcs);
+        return AVERROR_INVALIDDATA;
+    }
+    crcs = buf0 + crcs_pos;
+
+    av_fast_malloc(&s->crc_buf, &s->crc_buf_size, nb_crcs * 4);
+    av_fast_malloc(&s->tile_ret, &s->tile_ret_size, nb_crcs * sizeof(*s->tile_ret));
+    if (!s->crc_buf || !s->tile_ret)
+        return AVERROR(ENOMEM);
+
+    // stripes are independent, check them on the slice threads
+    cd.c          = &s->crc;
+    cd.data       = buf0 + hsize;
+    cd.size       = dsize;
+    cd.nb_stripes = nb_crcs;
+    cd.crcs       = s->crc_buf;
+    avctx->execute2(avctx, ff_spff_checksum_stripe, &cd, s->tile_ret, nb_crcs);
+
+    for (i = 0; i < nb_crcs; i++) {
+        if (s->tile_ret[i] < 0 ||
+            AV_RN32(s->crc_buf + 4 * i) != AV_RN32(crcs + 4 * i)) {
+            av_log(avctx, AV_LOG_ERROR, "checksum mismatch in stripe %d\n", i);
+            bad = 1;
+        }
+    }
+    if (bad && (avctx->err_recognition & AV_EF_EXPLODE))
+        return AVERROR_INVALIDDATA;
+    s->corrupt = bad;
+
+    return 0;
+}
+
+static int spff_decode_picture(AVCodecContext *avctx, AVPacket *avpkt)
+{
+    SPFFDecContext *s  = avctx->priv_data;
     const uint8_t *buf = avpkt->data;
     int buf_size       = avpkt->size;
-    AVFrame *p         = data;
+    AVFrame *p         = s->picture.f;
     unsigned int fsize, hsize;
     int width, height;
     unsigned int bit_count;
-   
-    unsigned int ihsize;
-    int i, n, linesize, ret;
+    SPFFCompression comp;
+    unsigned int ihsize, stripe_height = 0, tile_width = 0;
+    unsigned int levels = 0, level_offset = 0, nb_crcs = 0;
+    int n, linesize, ret;
+    int padded = 1, top_down;
+    int x0, y0, y0_file, shift = 0, out_w, out_h;
+    SPFFSliceData td;
 
     uint8_t *ptr;
     int dsize;
     const uint8_t *buf0 = buf;
+    GetByteContext gb;
 
     if (buf_size < 10) {
         av_log(avctx, AV_LOG_ERROR, "buf size too small (%d)\n", buf_size);
@@ -59,7 +493,8 @@ static int spff_decode_frame(AVCodecContext *avctx,
     }
 
     fsize = bytestream_get_le32(&buf); // filesize = image size + header size
-    if (buf_size < fsize) {
+    // skipped pictures only need the headers, streamed input stops there
+    if (buf_size < fsize && avctx->skip_frame != AVDISCARD_ALL) {
         av_log(avctx, AV_LOG_ERROR, "not enough data (%d < %u), trying to decode anyway\n",
                buf_size, fsize);
         fsize = buf_size;
@@ -74,6 +509,11 @@ static int spff_decode_frame(AVCodecContext *avctx,
         av_log(avctx, AV_LOG_ERROR, "invalid header size %u\n", hsize);
         return AVERROR_INVALIDDATA;
     }
+    if (buf_size < hsize) {
+        av_log(avctx, AV_LOG_ERROR, "not enough data for the headers (%d < %u)\n",
+               buf_size, hsize);
+        return AVERROR_INVALIDDATA;
+    }
 
     /* sometimes file size is set to some headers size, set a real size in that case */
     if (fsize == 10 || fsize == ihsize + 10)
@@ -98,13 +538,110 @@ static int spff_decode_frame(AVCodecContext *avctx,
 
     bit_count = bytestream_get_le16(&buf); // bit_count always =8 (RBG8)
 
-   
-    avctx->width  = width;
-    avctx->height = height > 0 ? height : -height; // make sure height is positive
+    if (ihsize >= SIZE_SPFFINFOHEADER_V2)
+        comp = bytestream_get_le32(&buf);
+    else
+        comp = SPFF_RGB;
+
+    if (comp != SPFF_RGB && comp != SPFF_RLE8 && comp != SPFF_DEFLATE &&
+        comp != SPFF_DELTA) {
+        av_log(avctx, AV_LOG_ERROR, "SPFF coding %d not supported\n", comp);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (ihsize >= SIZE_SPFFINFOHEADER_V3)
+        stripe_height = bytestream_get_le32(&buf);
+    if (ihsize >= SIZE_SPFFINFOHEADER_V4)
+        tile_width = bytestream_get_le32(&buf);
+    if (ihsize >= SIZE_SPFFINFOHEADER_V5)
+        levels = bytestream_get_le32(&buf);
+    if (ihsize >= SIZE_SPFFINFOHEADER_V6)
+        nb_crcs = AV_RL32(buf0 + SIZE_SPFFFILEHEADER + 44);
+    if (levels > 3) {
+        av_log(avctx, AV_LOG_ERROR, "invalid number of levels %u\n", levels);
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (comp == SPFF_DEFLATE && !stripe_height) {
+        av_log(avctx, AV_LOG_ERROR, "deflate coding without stripes\n");
+        return AVERROR_INVALIDDATA;
+    }
+    if (tile_width && (!stripe_height ||
+                       (comp != SPFF_RGB && comp != SPFF_DEFLATE))) {
+        av_log(avctx, AV_LOG_ERROR, "invalid tiles for SPFF coding %d\n", comp);
+        return AVERROR_INVALIDDATA;
+    }
+    if (bit_count > 8 && (comp != SPFF_RGB || tile_width || levels)) {
+        av_log(avctx, AV_LOG_ERROR, "truecolor pictures only support raw coding\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    // a negative height marks a top-down file like in BMP
+    top_down = height < 0;
+    if (height == INT_MIN ||
+        av_image_check_size(width, FFABS(height), 0, avctx) < 0)
+        return AVERROR_INVALIDDATA;
+    height = FFABS(height);
+
+    // checked against the whole picture, before looking at a thumbnail
+    s->corrupt = 0;
+    if (nb_crcs && (avctx->err_recognition & AV_EF_CRCCHECK) &&
+        avctx->skip_frame != AVDISCARD_ALL) {
+        unsigned int dsize = levels ? AV_RL32(buf0 + SIZE_SPFFFILEHEADER + 32)
+                                    : fsize - hsize;
+        if (dsize > buf_size - hsize) {
+            av_log(avctx, AV_LOG_ERROR, "invalid level offset %u\n", dsize);
+            return AVERROR_INVALIDDATA;
+        }
+        if ((ret = spff_verify_checksums(avctx, buf0, hsize, ihsize, nb_crcs,
+                                         comp, stripe_height, tile_width,
+                                         width, height, bit_count, dsize)) < 0)
+            return ret;
+    }
+
+    // lowres decodes the closest thumbnail, which is a raw picture
+    if (avctx->lowres && comp == SPFF_DELTA) {
+        av_log(avctx, AV_LOG_ERROR, "inter frames have no low resolution version\n");
+        return AVERROR_PATCHWELCOME;
+    }
+    if (avctx->lowres && levels) {
+        int level    = FFMIN(avctx->lowres, levels);
+        level_offset = AV_RL32(buf0 + SIZE_SPFFFILEHEADER + 32 + 4 * (level - 1));
+        width        = AV_CEIL_RSHIFT(width,  level);
+        height       = AV_CEIL_RSHIFT(height, level);
+        comp         = SPFF_RGB;
+        tile_width   = 0;
+    }
+    // without enough levels, the closest picture is halved after decoding
+    if (avctx->lowres)
+        shift = avctx->lowres - FFMIN(avctx->lowres, levels);
+    s->lowres_shift = shift;
+
+    // only the crop window ends up in the frame, it is given in the
+    // picture as output, the part of the decoded picture it covers is
+    // halved down to it
+    out_w = AV_CEIL_RSHIFT(width,  shift);
+    out_h = AV_CEIL_RSHIFT(height, shift);
+    if (s->crop_x >= out_w || s->crop_y >= out_h) {
+        av_log(avctx, AV_LOG_ERROR, "crop window is outside the %dx%d picture\n",
+               out_w, out_h);
+        return AVERROR(EINVAL);
+    }
+    out_w = s->crop_w ? FFMIN(s->crop_w, out_w - s->crop_x) : out_w - s->crop_x;
+    out_h = s->crop_h ? FFMIN(s->crop_h, out_h - s->crop_y) : out_h - s->crop_y;
+    x0 = s->crop_x << shift;
+    y0 = s->crop_y << shift;
+    avctx->width  = FFMIN(out_w << shift, width  - x0);
+    avctx->height = FFMIN(out_h << shift, height - y0);
+    y0_file       = top_down ? y0 : height - y0 - avctx->height;
     avctx->pix_fmt = AV_PIX_FMT_NONE; // set default pixel format
 
     if(bit_count == 8)
       avctx->pix_fmt = AV_PIX_FMT_BGR8; // set pixel format to BGR8
+    else if (bit_count == 24)
+      avctx->pix_fmt = AV_PIX_FMT_BGR24;
+    else if (bit_count == 32)
+      avctx->pix_fmt = AV_PIX_FMT_BGRA;
     else
       {
         av_log(avctx, AV_LOG_ERROR, "depth %u not supported\n", bit_count);
@@ -115,58 +652,658 @@ static int spff_decode_frame(AVCodecContext *avctx,
         return AVERROR_INVALIDDATA;
     }
 
-     // ff_get_buffer(AVCodecContext, AVFrame, int), get buffer for a frame
-    if ((ret = ff_get_buffer(avctx, p, 0)) < 0)
+    // probing only needs the size and format
+    if (avctx->skip_frame == AVDISCARD_ALL) {
+        avctx->width  = out_w;
+        avctx->height = out_h;
+        return 0;
+    }
+
+    if (comp == SPFF_DELTA &&
+        (!s->last_picture.f->buf[0] ||
+         s->last_picture.f->width  != avctx->width ||
+         s->last_picture.f->height != avctx->height)) {
+        av_log(avctx, AV_LOG_ERROR, "inter frame without a matching previous frame\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (level_offset > buf_size - hsize) {
+        av_log(avctx, AV_LOG_ERROR, "invalid level offset %u\n", level_offset);
+        return AVERROR_INVALIDDATA;
+    }
+    buf   = buf0 + hsize + level_offset;
+    dsize = buf_size - hsize - level_offset;
+
+    /* Line size in file multiple of 4, or of 64 for truecolor */
+    n = ff_spff_row_size(width, bit_count);
+    if (n * (int64_t)height > dsize && comp == SPFF_RGB && !tile_width) {
+        n = (width * bit_count + 7) / 8;
+        if (n * (int64_t)height > dsize) {
+            av_log(avctx, AV_LOG_ERROR, "not enough data (%d < %"PRId64")\n",
+                   dsize, n * (int64_t)height);
+            return AVERROR_INVALIDDATA;
+        }
+        av_log(avctx, AV_LOG_ERROR, "data size too small, assuming missing line alignment\n");
+        padded = 0;
+    }
+
+    // columns are counted in bytes from here on
+    x0 *= bit_count >> 3;
+
+    /* Reference the packet instead of copying it, unless the caller asked
+     * for its own buffers or the rows break the alignment rule, 4 bytes for
+     * palette rows and 64 for truecolor ones. Pictures still to be halved
+     * are halved in place, which needs a buffer of their own. */
+    if (s->zero_copy && comp == SPFF_RGB && !tile_width && padded && !shift &&
+        avpkt->buf && avctx->get_buffer2 == avcodec_default_get_buffer2 &&
+        !((uintptr_t)(buf + x0) & (bit_count > 8 ? SPFF_TRUECOLOR_ALIGN - 1 : 3))) {
+        if ((ret = spff_ref_packet(avctx, p, avpkt, buf + y0_file * n + x0,
+                                   n, top_down)) < 0)
+            return ret;
+        ff_thread_finish_setup(avctx);
+
+        p->pict_type = AV_PICTURE_TYPE_I;
+        p->key_frame = 1;
+
+        return 0;
+    }
+
+     // get buffer for a frame, kept as the reference of the next one
+    if ((ret = ff_thread_get_buffer(avctx, &s->picture, AV_GET_BUFFER_FLAG_REF)) < 0)
         return ret;
+    ff_thread_finish_setup(avctx);
 
     p->pict_type = AV_PICTURE_TYPE_I; // frame's picture type = Intra
     p->key_frame = 1;
 
-    buf   = buf0 + hsize;
-    dsize = buf_size - hsize;
+    // set pointer at the frame row of the first file row
+    if (!top_down) {
+        ptr      = p->data[0] + (avctx->height - 1) * p->linesize[0];
+        linesize = -p->linesize[0];
+    } else {
+        ptr      = p->data[0];
+        linesize = p->linesize[0];
+    }
+
+    if (comp == SPFF_DELTA) {
+        p->pict_type = AV_PICTURE_TYPE_P;
+        p->key_frame = 0;
 
-    /* Line size in file multiple of 4 */
-    n = ((avctx->width * bit_count + 31) / 8) & ~3;
-    if (n * avctx->height > dsize) {
-        n = (avctx->width * bit_count + 7) / 8;
-        if (n * avctx->height > dsize) {
-            av_log(avctx, AV_LOG_ERROR, "not enough data (%d < %d)\n",
-                   dsize, n * avctx->height);
+        ff_thread_await_progress(&s->last_picture, INT_MAX, 0);
+        bytestream2_init(&gb, buf, dsize);
+        return spff_decode_delta(avctx, p, s->last_picture.f, &gb,
+                                 width, height, x0, y0);
+    }
+
+    if (comp == SPFF_RLE8) {
+        uint8_t *rle_ptr = ptr;
+        int rle_linesize = linesize;
+        int i;
+
+        // runs are not indexed, a window needs the whole picture decoded
+        if (avctx->width != width || avctx->height != height) {
+            av_fast_malloc(&s->crop_buf, &s->crop_buf_size, width * height);
+            if (!s->crop_buf)
+                return AVERROR(ENOMEM);
+            rle_ptr      = s->crop_buf + (top_down ? 0 : (height - 1) * width);
+            rle_linesize = top_down ? width : -width;
+        }
+
+        // RLE may skip decoding some picture areas, so blank picture before decoding
+        for (i = 0; i < height; i++)
+            memset(rle_ptr + i * rle_linesize, 0, width);
+
+        bytestream2_init(&gb, buf, dsize);
+        if ((ret = spff_rle8_decode(avctx, rle_ptr, rle_linesize,
+                                    width, height, &gb)) < 0)
+            return ret;
+
+        if (rle_ptr != ptr)
+            av_image_copy_plane(p->data[0], p->linesize[0],
+                                s->crop_buf + y0 * width + x0, width,
+                                avctx->width, avctx->height);
+        return 0;
+    }
+
+    td.src       = buf;
+    td.dst       = ptr;
+    td.linesize  = linesize;
+    td.n         = n;
+    td.x         = x0;
+    td.y0        = y0_file;
+    td.width     = avctx->width * (bit_count >> 3);
+    td.height    = avctx->height;
+
+    if (comp == SPFF_DEFLATE || tile_width) {
+        int tiled       = tile_width != 0;
+        int tile_height = FFMIN(stripe_height, height);
+        int nb_tiles_x, nb_tiles_y, nb_jobs, i;
+
+#if !CONFIG_ZLIB
+        if (comp == SPFF_DEFLATE) {
+            av_log(avctx, AV_LOG_ERROR, "deflate coding requires zlib support\n");
+            return AVERROR(ENOSYS);
+        }
+#endif
+        // untiled deflate stripes are tiles as wide as the picture
+        if (!tile_width || tile_width > width)
+            tile_width = width;
+        nb_tiles_x = (width  + tile_width  - 1) / tile_width;
+        nb_tiles_y = (height + tile_height - 1) / tile_height;
+        if (hsize < SIZE_SPFFFILEHEADER + ihsize +
+                    ((int64_t)nb_tiles_x * nb_tiles_y + 1) * 4) {
+            av_log(avctx, AV_LOG_ERROR, "tile table doesn't fit in header\n");
             return AVERROR_INVALIDDATA;
         }
+
+        // tiles are independent, decode the ones crossing the window on
+        // the slice threads
+        td.comp           = comp;
+        td.tiled          = tiled;
+        td.picture_width  = width;
+        td.picture_height = height;
+        td.tile_width     = tile_width;
+        td.tile_height    = tile_height;
+        td.nb_tiles_x     = nb_tiles_x;
+        td.tx0            = x0 / tile_width;
+        td.ty0            = y0_file / tile_height;
+        td.ntx            = (x0 + avctx->width - 1) / tile_width - td.tx0 + 1;
+        td.dsize          = dsize;
+        td.tile_offsets   = buf0 + SIZE_SPFFFILEHEADER + ihsize;
+        nb_jobs = td.ntx * ((y0_file + avctx->height - 1) / tile_height - td.ty0 + 1);
+
+#if CONFIG_ZLIB
+        if (comp == SPFF_DEFLATE) {
+            av_fast_malloc(&s->row_buf, &s->row_buf_size, s->nb_zstreams * n);
+            if (!s->row_buf)
+                return AVERROR(ENOMEM);
+        }
+#endif
+        av_fast_malloc(&s->tile_ret, &s->tile_ret_size,
+                       nb_jobs * sizeof(*s->tile_ret));
+        if (!s->tile_ret)
+            return AVERROR(ENOMEM);
+        avctx->execute2(avctx, spff_decode_tile, &td, s->tile_ret, nb_jobs);
+        for (i = 0; i < nb_jobs; i++)
+            if (s->tile_ret[i] < 0)
+                return s->tile_ret[i];
+
+        return 0;
+    }
+
+    // rows are independent, split them into bands for the slice threads
+    td.nb_slices = avctx->active_thread_type & FF_THREAD_SLICE ?
+                   FFMIN(avctx->thread_count, avctx->height) : 1;
+    avctx->execute2(avctx, spff_decode_slice, &td, NULL, td.nb_slices);
+
+    return 0;
+}
+
+// halve the decoded picture in its own buffer down to the lowres size
+static void spff_halve_picture(AVCodecContext *avctx, AVFrame *p, int shift)
+{
+    int i;
+
+    for (i = 0; i < shift; i++) {
+        ff_spff_downscale(p->data[0], p->linesize[0], p->data[0], p->linesize[0],
+                          avctx->width, avctx->height, avctx->pix_fmt);
+        avctx->width  = AV_CEIL_RSHIFT(avctx->width,  1);
+        avctx->height = AV_CEIL_RSHIFT(avctx->height, 1);
+    }
+    p->width  = avctx->width;
+    p->height = avctx->height;
+}
+
+static int spff_decode_file(AVCodecContext *avctx, AVFrame *frame,
+                            AVPacket *avpkt)
+{
+    SPFFDecContext *s = avctx->priv_data;
+    int ret;
+
+    // the previous frame becomes the reference
+    ff_thread_release_buffer(avctx, &s->last_picture);
+    FFSWAP(ThreadFrame, s->picture, s->last_picture);
+
+    ret = spff_decode_picture(avctx, avpkt);
+    if (ret >= 0 && s->lowres_shift)
+        spff_halve_picture(avctx, s->picture.f, s->lowres_shift);
+    // don't leave the next frame thread waiting if decoding failed
+    ff_thread_report_progress(&s->picture, INT_MAX, 0);
+    if (ret < 0)
+        return ret;
+
+    if (s->corrupt)
+        s->picture.f->flags |= AV_FRAME_FLAG_CORRUPT;
+    return av_frame_ref(frame, s->picture.f);
+}
+
+static void spff_stream_reset(SPFFDecContext *s)
+{
+    s->stream_state = SPFF_STREAM_HEADER;
+    s->stream_pos   = 0;
+}
+
+// pass the rows completed since the last call to draw_horiz_band
+static void spff_stream_draw_band(AVCodecContext *avctx, int last)
+{
+    SPFFDecContext *s = avctx->priv_data;
+    AVFrame *p        = s->picture.f;
+    int offset[AV_NUM_DATA_POINTERS] = { 0 };
+    int y, h;
+
+    if (!avctx->draw_horiz_band)
+        return;
+
+    if (s->stream_top_down) {
+        y = s->stream_rows_drawn;
+    } else {
+        // bottom-up rows come last row first, which is the coded order
+        if (!(avctx->slice_flags & SLICE_FLAG_CODED_ORDER) && !last)
+            return;
+        y = avctx->height - s->stream_rows;
+    }
+    h = s->stream_rows - s->stream_rows_drawn;
+    if (h <= 0)
+        return;
+
+    offset[0] = y * p->linesize[0];
+    avctx->draw_horiz_band(avctx, p, offset, y, 3, h);
+    s->stream_rows_drawn = s->stream_rows;
+}
+
+/*
+ * Start decoding a file once its headers are in. Plain raw pictures get a
+ * frame right away and their rows are copied to it as they arrive, anything
+ * else is gathered and decoded by spff_decode_picture() as a whole.
+ */
+static int spff_stream_start(AVCodecContext *avctx)
+{
+    SPFFDecContext *s   = avctx->priv_data;
+    const uint8_t *buf  = s->stream_buf;
+    unsigned int ihsize = AV_RL32(buf + 10);
+    int width           = AV_RL32(buf + 14);
+    int height          = AV_RL32(buf + 18);
+    int64_t dsize       = s->stream_fsize - s->stream_hsize;
+    SPFFCompression comp = SPFF_RGB;
+    unsigned int tile_width = 0;
+    AVFrame *p;
+    int ret;
+
+    // skipped pictures only set the size and format, the rest of the file
+    // is dropped without being buffered
+    if (avctx->skip_frame == AVDISCARD_ALL) {
+        AVPacket pkt;
+
+        av_init_packet(&pkt);
+        pkt.data = s->stream_buf;
+        pkt.size = s->stream_hsize;
+        if ((ret = spff_decode_picture(avctx, &pkt)) < 0)
+            return ret;
+        s->stream_state = SPFF_STREAM_SKIP;
+        return 0;
+    }
+
+    s->stream_state = SPFF_STREAM_FILE;
+    if (ihsize + 10LL > s->stream_hsize)
+        return 0;
+    if (ihsize >= SIZE_SPFFINFOHEADER_V2)
+        comp = AV_RL32(buf + 26);
+    if (ihsize >= SIZE_SPFFINFOHEADER_V4)
+        tile_width = AV_RL32(buf + 34);
+    // checksums need the whole picture before it can be output
+    if (ihsize >= SIZE_SPFFINFOHEADER_V6 && AV_RL32(buf + 54) &&
+        (avctx->err_recognition & AV_EF_CRCCHECK))
+        return 0;
+
+    if (comp != SPFF_RGB || tile_width || avctx->lowres ||
+        s->crop_x || s->crop_y || s->crop_w || s->crop_h ||
+        AV_RL16(buf + 22) != 1 || AV_RL16(buf + 24) != 8 ||
+        height == INT_MIN || av_image_check_size(width, FFABS(height), 0, avctx) < 0)
+        return 0;
+
+    s->stream_top_down = height < 0;
+    height             = FFABS(height);
+    s->stream_n        = FFALIGN(width, 4);
+    if (s->stream_n * (int64_t)height > dsize) {
+        if (width * (int64_t)height > dsize)
+            return 0;
         av_log(avctx, AV_LOG_ERROR, "data size too small, assuming missing line alignment\n");
+        s->stream_n = width;
     }
-    // set pointer
-    ptr      = p->data[0] + (avctx->height - 1) * p->linesize[0];
-    linesize = -p->linesize[0];
 
-    if(bit_count == 8)
-      {
-	for (i = 0; i < avctx->height; i++) {
-	  // copies count bytes from the object pointed to by src to the object 
-	  // pointed to by dest. memcpy(destination, source, count bytes)
-	  memcpy(ptr, buf, n); 
-	  //move pointers
-	  buf += n;
-	  ptr += linesize;
-	}
-      }
-    else
-      {
-	av_log(avctx, AV_LOG_ERROR, "SPFF decoder is broken\n");
-	return AVERROR_INVALIDDATA;
-      }
+    avctx->width   = width;
+    avctx->height  = height;
+    avctx->pix_fmt = AV_PIX_FMT_BGR8;
+
+    ff_thread_release_buffer(avctx, &s->last_picture);
+    FFSWAP(ThreadFrame, s->picture, s->last_picture);
+    if ((ret = ff_thread_get_buffer(avctx, &s->picture, AV_GET_BUFFER_FLAG_REF)) < 0)
+        return ret;
+    p            = s->picture.f;
+    p->pict_type = AV_PICTURE_TYPE_I;
+    p->key_frame = 1;
+
+    s->stream_rows       = 0;
+    s->stream_rows_drawn = 0;
+    s->stream_state      = SPFF_STREAM_ROWS;
+    return 0;
+}
+
+// copy the raw rows in buf to the frame, returns the bytes used
+static int spff_stream_rows(AVCodecContext *avctx, const uint8_t *buf,
+                            int buf_size)
+{
+    SPFFDecContext *s = avctx->priv_data;
+    AVFrame *p        = s->picture.f;
+    int n             = s->stream_n;
+    int used          = 0;
+
+    while (used < buf_size && s->stream_rows < avctx->height) {
+        int col = (s->stream_pos - s->stream_hsize) % n;
+        int y   = s->stream_top_down ? s->stream_rows
+                                     : avctx->height - 1 - s->stream_rows;
+        int len = FFMIN(buf_size - used, n - col);
+
+        if (col < avctx->width)
+            memcpy(p->data[0] + y * p->linesize[0] + col, buf + used,
+                   FFMIN(len, avctx->width - col));
+        used          += len;
+        s->stream_pos += len;
+        if (col + len == n)
+            s->stream_rows++;
+    }
+    return used;
+}
+
+/*
+ * Decode input cut anywhere, as allowed by AV_CODEC_FLAG_TRUNCATED.
+ * Only the bytes up to the end of a frame are consumed, the rest of the
+ * packet is passed again for the next frame.
+ */
+static int spff_decode_stream(AVCodecContext *avctx, AVFrame *frame,
+                              int *got_frame, AVPacket *avpkt)
+{
+    SPFFDecContext *s  = avctx->priv_data;
+    const uint8_t *buf = avpkt->data;
+    int buf_size       = avpkt->size;
+    int used = 0, ret  = 0;
+
+    while (used < buf_size && !*got_frame) {
+        const uint8_t *src = buf + used;
+        int avail          = buf_size - used;
+        unsigned int want;
+        int len;
+
+        switch (s->stream_state) {
+        case SPFF_STREAM_HEADER:
+        case SPFF_STREAM_FILE:
+            want = s->stream_state == SPFF_STREAM_FILE ? s->stream_fsize :
+                   s->stream_pos < SIZE_SPFFFILEHEADER ? SIZE_SPFFFILEHEADER :
+                                                         s->stream_hsize;
+            len  = FFMIN(avail, want - s->stream_pos);
+            if (s->stream_buf_size < want + AV_INPUT_BUFFER_PADDING_SIZE) {
+                uint8_t *tmp = av_fast_realloc(s->stream_buf, &s->stream_buf_size,
+                                               want + AV_INPUT_BUFFER_PADDING_SIZE);
+                if (!tmp) {
+                    ret = AVERROR(ENOMEM);
+                    goto fail;
+                }
+                s->stream_buf = tmp;
+            }
+            memcpy(s->stream_buf + s->stream_pos, src, len);
+            s->stream_pos += len;
+            used          += len;
+            if (s->stream_pos < want)
+                break;
+
+            if (s->stream_state == SPFF_STREAM_FILE) {
+                AVPacket pkt;
+
+                memset(s->stream_buf + want, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+                av_init_packet(&pkt);
+                pkt.data = s->stream_buf;
+                pkt.size = s->stream_fsize;
+                spff_stream_reset(s);
+                if (avctx->skip_frame == AVDISCARD_ALL) {
+                    ret = spff_decode_picture(avctx, &pkt);
+                    return ret < 0 ? ret : used;
+                }
+                if ((ret = spff_decode_file(avctx, frame, &pkt)) < 0)
+                    return ret;
+                // one band for the whole picture
+                s->stream_top_down   = 1;
+                s->stream_rows       = avctx->height;
+                s->stream_rows_drawn = 0;
+                spff_stream_draw_band(avctx, 1);
+                *got_frame = 1;
+            } else if (want == SIZE_SPFFFILEHEADER) {
+                if (AV_RB16(s->stream_buf) != (('S' << 8) | 'F')) {
+                    av_log(avctx, AV_LOG_ERROR, "bad magic number\n");
+                    ret = AVERROR_INVALIDDATA;
+                    goto fail;
+                }
+                s->stream_fsize = AV_RL32(s->stream_buf + 2);
+                s->stream_hsize = AV_RL32(s->stream_buf + 6);
+                if (s->stream_hsize < SIZE_SPFFFILEHEADER + SIZE_SPFFINFOHEADER ||
+                    s->stream_fsize <= s->stream_hsize ||
+                    s->stream_fsize > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+                    av_log(avctx, AV_LOG_ERROR, "invalid file size %u\n",
+                           s->stream_fsize);
+                    ret = AVERROR_INVALIDDATA;
+                    goto fail;
+                }
+            } else if ((ret = spff_stream_start(avctx)) < 0) {
+                goto fail;
+            }
+            break;
+        case SPFF_STREAM_ROWS:
+            used += spff_stream_rows(avctx, src, avail);
+            spff_stream_draw_band(avctx, s->stream_rows == avctx->height);
+            if (s->stream_rows < avctx->height)
+                break;
+
+            ff_thread_report_progress(&s->picture, INT_MAX, 0);
+            if ((ret = av_frame_ref(frame, s->picture.f)) < 0)
+                goto fail;
+            *got_frame = 1;
+            // thumbnails may follow the rows
+            s->stream_state = SPFF_STREAM_SKIP;
+            // fall through
+        case SPFF_STREAM_SKIP:
+            len = FFMIN(buf_size - used, s->stream_fsize - s->stream_pos);
+            s->stream_pos += len;
+            used          += len;
+            if (s->stream_pos == s->stream_fsize) {
+                spff_stream_reset(s);
+                // one skipped picture per call, like the decoded ones
+                if (!*got_frame)
+                    return used;
+            }
+            break;
+        }
+    }
+
+    return used;
+fail:
+    spff_stream_reset(s);
+    return ret;
+}
+
+static int spff_decode_frame(AVCodecContext *avctx,
+                            void *data, int *got_frame,
+                            AVPacket *avpkt)
+{
+    int ret;
+
+    if (avctx->flags & AV_CODEC_FLAG_TRUNCATED)
+        return spff_decode_stream(avctx, data, got_frame, avpkt);
 
+    // header only, the reference is left as it is
+    if (avctx->skip_frame == AVDISCARD_ALL) {
+        ret = spff_decode_picture(avctx, avpkt);
+        *got_frame = 0;
+        return ret < 0 ? ret : avpkt->size;
+    }
+
+    if ((ret = spff_decode_file(avctx, data, avpkt)) < 0)
+        return ret;
     *got_frame = 1;
 
-    return buf_size;
+    return avpkt->size;
+}
+
+static av_cold int spff_decode_init(AVCodecContext *avctx)
+{
+    SPFFDecContext *s = avctx->priv_data;
+#if CONFIG_ZLIB
+    int nb_zstreams   = avctx->active_thread_type & FF_THREAD_SLICE ?
+                        FFMAX(avctx->thread_count, 1) : 1;
+    int ret;
+#endif
+
+    // frame thread copies start with the pointers of the first context
+    s->palette         = NULL;
+    s->picture.f       = av_frame_alloc();
+    s->last_picture.f  = av_frame_alloc();
+#if CONFIG_ZLIB
+    s->zstream         = NULL;
+    s->nb_zstreams     = 0;
+    s->row_buf         = NULL;
+    s->row_buf_size    = 0;
+#endif
+    s->crop_buf        = NULL;
+    s->crop_buf_size   = 0;
+    s->tile_ret        = NULL;
+    s->tile_ret_size   = 0;
+    s->crc_buf         = NULL;
+    s->crc_buf_size    = 0;
+    s->stream_buf      = NULL;
+    s->stream_buf_size = 0;
+    spff_stream_reset(s);
+    if (!s->picture.f || !s->last_picture.f)
+        return AVERROR(ENOMEM);
+
+    ff_spff_crc_init(&s->crc);
+
+#if CONFIG_ZLIB
+    // one inflater per slice thread for deflate coded stripes
+    s->zstream = av_mallocz_array(nb_zstreams, sizeof(*s->zstream));
+    if (!s->zstream)
+        return AVERROR(ENOMEM);
+    for (; s->nb_zstreams < nb_zstreams; s->nb_zstreams++) {
+        z_stream *zstream = &s->zstream[s->nb_zstreams];
+        zstream->zalloc = Z_NULL;
+        zstream->zfree  = Z_NULL;
+        zstream->opaque = Z_NULL;
+        if ((ret = inflateInit(zstream)) != Z_OK) {
+            av_log(avctx, AV_LOG_ERROR, "inflateInit returned error %d\n", ret);
+            return AVERROR_EXTERNAL;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+static av_cold int spff_decode_close(AVCodecContext *avctx)
+{
+    SPFFDecContext *s = avctx->priv_data;
+
+    ff_thread_release_buffer(avctx, &s->picture);
+    av_frame_free(&s->picture.f);
+    ff_thread_release_buffer(avctx, &s->last_picture);
+    av_frame_free(&s->last_picture.f);
+    av_buffer_unref(&s->palette);
+#if CONFIG_ZLIB
+    for (; s->nb_zstreams > 0; s->nb_zstreams--)
+        inflateEnd(&s->zstream[s->nb_zstreams - 1]);
+    av_freep(&s->zstream);
+    av_freep(&s->row_buf);
+    s->row_buf_size = 0;
+#endif
+    av_freep(&s->crop_buf);
+    s->crop_buf_size = 0;
+    av_freep(&s->tile_ret);
+    s->tile_ret_size = 0;
+    av_freep(&s->crc_buf);
+    s->crc_buf_size = 0;
+    av_freep(&s->stream_buf);
+    s->stream_buf_size = 0;
+
+    return 0;
 }
 
+static void spff_decode_flush(AVCodecContext *avctx)
+{
+    SPFFDecContext *s = avctx->priv_data;
+
+    ff_thread_release_buffer(avctx, &s->picture);
+    ff_thread_release_buffer(avctx, &s->last_picture);
+    spff_stream_reset(s);
+}
+
+#if HAVE_THREADS
+static int spff_decode_update_thread_context(AVCodecContext *dst,
+                                             const AVCodecContext *src)
+{
+    SPFFDecContext *psrc = src->priv_data;
+    SPFFDecContext *pdst = dst->priv_data;
+    int ret;
+
+    if (dst == src)
+        return 0;
+
+    // the frame of the previous thread is the reference of the next one
+    ff_thread_release_buffer(dst, &pdst->picture);
+    if (psrc->picture.f->buf[0] &&
+        (ret = ff_thread_ref_frame(&pdst->picture, &psrc->picture)) < 0)
+        return ret;
+
+    return 0;
+}
+#endif
+
+#define OFFSET(x) offsetof(SPFFDecContext, x)
+#define VD AV_OPT_FLAG_DECODING_PARAM | AV_OPT_FLAG_VIDEO_PARAM
+static const AVOption options[] = {
+    { "zero_copy", "reference the packet data instead of copying the rows when possible",
+      OFFSET(zero_copy), AV_OPT_TYPE_BOOL, { .i64 = 1 }, 0, 1, VD },
+    { "crop_x", "left edge of the window to decode",
+      OFFSET(crop_x), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD },
+    { "crop_y", "top edge of the window to decode",
+      OFFSET(crop_y), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD },
+    { "crop_w", "width of the window to decode, 0 for up to the right edge",
+      OFFSET(crop_w), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD },
+    { "crop_h", "height of the window to decode, 0 for down to the bottom edge",
+      OFFSET(crop_h), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VD },
+    { NULL },
+};
+
+static const AVClass decoder_class = {
+    .class_name = "spff decoder",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+    .category   = AV_CLASS_CATEGORY_DECODER,
+};
+
 AVCodec ff_spff_decoder = {
     .name           = "spff",
     .long_name      = NULL_IF_CONFIG_SMALL("SPFF image (a project for CS 3505)"),
     .type           = AVMEDIA_TYPE_VIDEO,
     .id             = AV_CODEC_ID_SPFF,
+    .priv_data_size = sizeof(SPFFDecContext),
+    .init           = spff_decode_init,
+    .init_thread_copy = ONLY_IF_THREADS_ENABLED(spff_decode_init),
+    .update_thread_context = ONLY_IF_THREADS_ENABLED(spff_decode_update_thread_context),
+    .close          = spff_decode_close,
     .decode         = spff_decode_frame,
-    .capabilities   = AV_CODEC_CAP_DR1,
+    .flush          = spff_decode_flush,
+    .max_lowres     = 3,
+    .capabilities   = AV_CODEC_CAP_DR1 | AV_CODEC_CAP_SLICE_THREADS |
+                      AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_TRUNCATED |
+                      AV_CODEC_CAP_DRAW_HORIZ_BAND,
+    .caps_internal  = FF_CODEC_CAP_SKIP_FRAME_FILL_PARAM |
+                      FF_CODEC_CAP_INIT_CLEANUP,
+    .priv_class     = &decoder_class,
 };
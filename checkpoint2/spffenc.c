@@ -22,106 +22,936 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
  */
 
+#include <inttypes.h>
+
+#include "config.h"
+
+#if CONFIG_ZLIB
+#include <zlib.h>
+#endif
+
 #include "libavutil/imgutils.h"
 #include "libavutil/avassert.h"
+#include "libavutil/opt.h"
 #include "bytestream.h"
 #include "avcodec.h"
 #include "internal.h"
+#include "spff.h"
+
+// worst case for one RLE8 row: every pixel in a run of its own, plus the
+// end of line code
+#define RLE8_MAX_ROW_SIZE(width) (2 * (width) + 2)
+
+// inter frames look for changes in blocks of this many pixels squared
+#define DELTA_BLOCK_SIZE 16
+
+typedef struct SPFFRect {
+  int x, y, w, h;
+} SPFFRect;
+
+typedef struct SPFFEncContext {
+  const AVClass *class;
+  int top_down; // store rows top-down, signalled by a negative height
+  int compression;
+  int stripe_height;
+  int tile_width;  // 0 for whole rows
+  int levels;      // downscaled copies stored after the picture
+  uint8_t *level_buf; // the downscaled copies, top row first
+  int dither;      // ordered dithering when quantizing to 3-3-2
+  AVFrame *quant;  // 3-3-2 picture for the codings that read it more than once
+  int yuv_offset, yuv_y, yuv_rv, yuv_gu, yuv_gv, yuv_bu; // YUV to RGB, 8.8 fixed point
+  int *slice_size; // bytes produced by each slice when compressing
+  unsigned int slice_size_alloc;
+  int keyint;      // frames between keyframes, 1 makes every frame intra
+  int frame_num;   // frames since the last keyframe
+  uint8_t *prev;   // previous picture, top row first, for inter frames
+  SPFFRect *rects; // changed areas of the current inter frame
+  int *open_rect;  // per block column, rect ending at the current block row
+  int checksums;   // store a CRC-32C of every stripe
+  SPFFCRCContext crc;
+#if CONFIG_ZLIB
+  z_stream *zstream; // one per slice thread
+  int nb_zstreams;
+#endif
+} SPFFEncContext;
+
+// rows handed to the slice threads, src already points at the first row
+typedef struct SPFFSliceData {
+  const uint8_t *src;
+  uint8_t *dst;
+  int linesize;          // frame linesize, negative when writing bottom-up
+  int n_bytes_per_row;
+  int pad_bytes_per_row;
+  int height;
+  int nb_slices;
+  int *slice_size;
+  int stripe_height;
+  int stripe_size;       // room reserved for each deflated stripe
+  int tile_width;        // the picture width when not tiled
+  int nb_tiles_x;
+  const AVFrame *frame;  // input to quantize on the fly, NULL for 3-3-2 input
+} SPFFSliceData;
 
 // Get AVCodecContext and make sure it is the correct color scheme
 static av_cold int spff_encode_init(AVCodecContext *avctx){
+  SPFFEncContext *s = avctx->priv_data;
+
   if(avctx->pix_fmt == AV_PIX_FMT_RGB8||avctx->pix_fmt == AV_PIX_FMT_BGR8)
     {
       avctx->bits_per_coded_sample = 8;
     }
+  else if (avctx->pix_fmt == AV_PIX_FMT_RGB24 ||
+           avctx->pix_fmt == AV_PIX_FMT_YUV420P ||
+           avctx->pix_fmt == AV_PIX_FMT_YUVJ420P) {
+    // quantized to BGR8 while encoding, the scratch picture is only
+    // allocated for the codings that need it
+    avctx->bits_per_coded_sample = 8;
+    s->quant = av_frame_alloc();
+    if (!s->quant)
+      return AVERROR(ENOMEM);
+    if (avctx->pix_fmt == AV_PIX_FMT_YUVJ420P ||
+        avctx->color_range == AVCOL_RANGE_JPEG) {
+      s->yuv_offset = 0;  s->yuv_y  = 256; s->yuv_rv = 359;
+      s->yuv_gu     = 88; s->yuv_gv = 183; s->yuv_bu = 454;
+    } else {
+      s->yuv_offset = 16;  s->yuv_y  = 298; s->yuv_rv = 409;
+      s->yuv_gu     = 100; s->yuv_gv = 208; s->yuv_bu = 516;
+    }
+  }
+  else if (avctx->pix_fmt == AV_PIX_FMT_BGR24 ||
+           avctx->pix_fmt == AV_PIX_FMT_BGRA) {
+    // stored as they are, without quantizing
+    avctx->bits_per_coded_sample = avctx->pix_fmt == AV_PIX_FMT_BGRA ? 32 : 24;
+    if (s->compression != SPFF_RGB || s->tile_width || s->levels ||
+        s->keyint > 1) {
+      av_log(avctx, AV_LOG_ERROR, "truecolor pictures only support raw coding\n");
+      return AVERROR(EINVAL);
+    }
+  }
   else {
-    av_log(avctx, AV_LOG_INFO, "unsupported pixel format, only support RBG8\n");
+    av_log(avctx, AV_LOG_INFO, "unsupported pixel format, only support RBG8, BGR24 and BGRA\n");
+    return AVERROR(EINVAL);
+  }
+
+  if (s->tile_width && s->compression == SPFF_RLE8) {
+    av_log(avctx, AV_LOG_ERROR, "tiles require raw or deflate coding\n");
     return AVERROR(EINVAL);
   }
+
+  if (s->levels) {
+    int l, size = 0;
+
+    for (l = 1; l <= s->levels; l++)
+      size += AV_CEIL_RSHIFT(avctx->width, l) * AV_CEIL_RSHIFT(avctx->height, l);
+    s->level_buf = av_malloc(size);
+    if (!s->level_buf)
+      return AVERROR(ENOMEM);
+  }
+
+  if (s->checksums)
+    ff_spff_crc_init(&s->crc);
+
+  // lowres decoding needs the thumbnails of every frame, inter frames
+  // have none
+  if (s->keyint > 1 && s->levels) {
+    av_log(avctx, AV_LOG_WARNING, "inter frames have no levels, keyint ignored\n");
+    s->keyint = 1;
+  }
+
+  if (s->keyint > 1) {
+    int bw = (avctx->width  + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+    int bh = (avctx->height + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+
+    // an inter frame has at most one rect per block
+    s->prev      = av_malloc_array(avctx->width, avctx->height);
+    s->rects     = av_malloc_array(bw * bh, sizeof(*s->rects));
+    s->open_rect = av_mallocz_array(bw, sizeof(*s->open_rect));
+    if (!s->prev || !s->rects || !s->open_rect)
+      return AVERROR(ENOMEM);
+  }
+
+  if (s->compression == SPFF_DEFLATE) {
+#if CONFIG_ZLIB
+    int nb_zstreams = FFMAX(avctx->thread_count, 1);
+    int level = avctx->compression_level == FF_COMPRESSION_DEFAULT ?
+                Z_DEFAULT_COMPRESSION : av_clip(avctx->compression_level, 0, 9);
+    int ret;
+
+    // one deflater per slice thread, stripes are compressed independently
+    s->zstream = av_mallocz_array(nb_zstreams, sizeof(*s->zstream));
+    if (!s->zstream)
+      return AVERROR(ENOMEM);
+    for (; s->nb_zstreams < nb_zstreams; s->nb_zstreams++) {
+      z_stream *zstream = &s->zstream[s->nb_zstreams];
+      zstream->zalloc = Z_NULL;
+      zstream->zfree  = Z_NULL;
+      zstream->opaque = Z_NULL;
+      if ((ret = deflateInit(zstream, level)) != Z_OK) {
+        av_log(avctx, AV_LOG_ERROR, "deflateInit returned error %d\n", ret);
+        return AVERROR_EXTERNAL;
+      }
+    }
+#else
+    av_log(avctx, AV_LOG_ERROR, "deflate coding requires zlib support\n");
+    return AVERROR(ENOSYS);
+#endif
+  }
+  return 0;
+}
+
+static av_cold int spff_encode_close(AVCodecContext *avctx)
+{
+  SPFFEncContext *s = avctx->priv_data;
+  int ret = 0;
+
+  av_freep(&s->slice_size);
+  s->slice_size_alloc = 0;
+  av_freep(&s->level_buf);
+  av_frame_free(&s->quant);
+  av_freep(&s->prev);
+  av_freep(&s->rects);
+  av_freep(&s->open_rect);
+#if CONFIG_ZLIB
+  for (; s->nb_zstreams > 0; s->nb_zstreams--)
+    if (deflateEnd(&s->zstream[s->nb_zstreams - 1]) != Z_OK)
+      ret = AVERROR_EXTERNAL;
+  av_freep(&s->zstream);
+#endif
+  return ret;
+}
+
+// number of equal pixels at the start of src, checking 8 pixels at a time
+static int spff_run_length(const uint8_t *src, int len)
+{
+  uint64_t pattern = src[0] * 0x0101010101010101ULL;
+  int i = 1;
+
+  for (; i + 8 <= len; i += 8) {
+    uint64_t diff = AV_RL64(src + i) ^ pattern;
+    if (diff)
+      return i + (ff_ctzll(diff) >> 3);
+  }
+  while (i < len && src[i] == src[0])
+    i++;
+  return i;
+}
+
+// number of pixels before the next pair of equal neighbours, checking
+// 8 pairs at a time (a zero byte in src ^ (src + 1) marks a pair)
+static int spff_literal_length(const uint8_t *src, int len)
+{
+  int i = 0;
+
+  for (; i + 9 <= len; i += 8) {
+    uint64_t x = AV_RL64(src + i) ^ AV_RL64(src + i + 1);
+    uint64_t z = (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+    if (z)
+      return i + (ff_ctzll(z) >> 3);
+  }
+  for (; i + 1 < len; i++)
+    if (src[i] == src[i + 1])
+      return i;
+  return len;
+}
+
+// RLE8 code one row, in the bitstream BMP uses, without the end of line
+static uint8_t *spff_rle8_encode_row(uint8_t *buf, const uint8_t *ptr, int width)
+{
+  int x = 0;
+
+  while (x < width) {
+    int len = FFMIN(width - x, 255);
+    int run = spff_run_length(ptr + x, len);
+
+    if (run >= 2) {
+      // encoded mode
+      bytestream_put_byte(&buf, run);
+      bytestream_put_byte(&buf, ptr[x]);
+      x += run;
+      continue;
+    }
+
+    run = spff_literal_length(ptr + x, len);
+    if (run < 3) {
+      // absolute mode needs at least 3 pixels, use runs of one instead
+      for (; run > 0; run--, x++) {
+        bytestream_put_byte(&buf, 1);
+        bytestream_put_byte(&buf, ptr[x]);
+      }
+    } else {
+      // absolute mode, padded to 16 bits
+      bytestream_put_byte(&buf, 0);
+      bytestream_put_byte(&buf, run);
+      bytestream_put_buffer(&buf, ptr + x, run);
+      if (run & 1)
+        bytestream_put_byte(&buf, 0);
+      x += run;
+    }
+  }
+  return buf;
+}
+
+// RLE8 code one band of rows, each band starts at its worst case offset
+static int spff_rle8_slice(AVCodecContext *avctx, void *arg,
+                           int jobnr, int threadnr)
+{
+  const SPFFSliceData *td = arg;
+  int start = (td->height *  jobnr     ) / td->nb_slices;
+  int end   = (td->height * (jobnr + 1)) / td->nb_slices;
+  const uint8_t *ptr = td->src + start * td->linesize;
+  uint8_t *buf0      = td->dst + start * RLE8_MAX_ROW_SIZE(avctx->width);
+  uint8_t *buf       = buf0;
+  int i;
+
+  for (i = start; i < end; i++) {
+    buf = spff_rle8_encode_row(buf, ptr, avctx->width);
+    bytestream_put_byte(&buf, 0);
+    bytestream_put_byte(&buf, i == td->height - 1); // end of line or picture
+    ptr += td->linesize;
+  }
+  td->slice_size[jobnr] = buf - buf0;
+  return 0;
+}
+
+static const uint8_t dither_4x4[4][4] = {
+  {  0,  8,  2, 10 },
+  { 12,  4, 14,  6 },
+  {  3, 11,  1,  9 },
+  { 15,  7, 13,  5 },
+};
+
+// 3-3-2 BGR8 pixel, t is the rounding threshold out of 256
+static av_always_inline int spff_pack332(int r, int g, int b, int t)
+{
+  return (r * 7 + t) >> 8 | (g * 7 + t) >> 8 << 3 | (b * 3 + t) >> 8 << 6;
+}
+
+// quantize row y of an RGB24 or YUV 4:2:0 picture to BGR8
+static void spff_quantize_row(AVCodecContext *avctx, uint8_t *dst,
+                              const AVFrame *p, int y)
+{
+  SPFFEncContext *s = avctx->priv_data;
+  uint8_t t[4];
+  int x;
+
+  for (x = 0; x < 4; x++)
+    t[x] = s->dither ? dither_4x4[y & 3][x] * 16 + 8 : 128;
+
+  if (avctx->pix_fmt == AV_PIX_FMT_RGB24) {
+    const uint8_t *src = p->data[0] + y * p->linesize[0];
+
+    for (x = 0; x < avctx->width; x++)
+      dst[x] = spff_pack332(src[3 * x], src[3 * x + 1], src[3 * x + 2], t[x & 3]);
+  } else {
+    const uint8_t *luma = p->data[0] +  y       * p->linesize[0];
+    const uint8_t *cb   = p->data[1] + (y >> 1) * p->linesize[1];
+    const uint8_t *cr   = p->data[2] + (y >> 1) * p->linesize[2];
+
+    for (x = 0; x < avctx->width; x++) {
+      int l = (luma[x] - s->yuv_offset) * s->yuv_y + 128;
+      int u = cb[x >> 1] - 128;
+      int v = cr[x >> 1] - 128;
+
+      dst[x] = spff_pack332(av_clip_uint8((l + s->yuv_rv * v) >> 8),
+                            av_clip_uint8((l - s->yuv_gu * u - s->yuv_gv * v) >> 8),
+                            av_clip_uint8((l + s->yuv_bu * u) >> 8), t[x & 3]);
+    }
+  }
+}
+
+// quantize one band of rows into the scratch picture
+static int spff_quantize_slice(AVCodecContext *avctx, void *arg,
+                               int jobnr, int threadnr)
+{
+  SPFFEncContext *s       = avctx->priv_data;
+  const SPFFSliceData *td = arg;
+  int start = (td->height *  jobnr     ) / td->nb_slices;
+  int end   = (td->height * (jobnr + 1)) / td->nb_slices;
+  int y;
+
+  for (y = start; y < end; y++)
+    spff_quantize_row(avctx, s->quant->data[0] + y * s->quant->linesize[0],
+                      td->frame, y);
+  return 0;
+}
+
+// copy one band of rows into the packet
+static int spff_encode_slice(AVCodecContext *avctx, void *arg,
+                             int jobnr, int threadnr)
+{
+  SPFFEncContext *s       = avctx->priv_data;
+  const SPFFSliceData *td = arg;
+  int stride = td->n_bytes_per_row + td->pad_bytes_per_row;
+  int start  = (td->height *  jobnr     ) / td->nb_slices;
+  int end    = (td->height * (jobnr + 1)) / td->nb_slices;
+  const uint8_t *ptr = td->src + start * td->linesize;
+  uint8_t *buf       = td->dst + start * stride;
+  int i;
+
+  if (td->frame) {
+    // quantize straight into the packet, file row i is picture row i or
+    // counted from the bottom, whatever the sign of the frame linesize
+    for (i = start; i < end; i++) {
+      spff_quantize_row(avctx, buf, td->frame,
+                        s->top_down ? i : td->height - 1 - i);
+      memset(buf + td->n_bytes_per_row, 0, td->pad_bytes_per_row);
+      buf += stride;
+    }
+    return 0;
+  }
+
+  if (td->linesize == stride) {
+    // the frame rows are laid out like the file, copy them in one go
+    // and only clear the padding afterwards
+    memcpy(buf, ptr, (end - start) * stride);
+    for (i = 0; td->pad_bytes_per_row && i < end - start; i++)
+      memset(buf + i * stride + td->n_bytes_per_row, 0, td->pad_bytes_per_row);
+    return 0;
+  }
+
+  for(i = start; i < end; i++) {
+    // copies count bytes from the object pointed to by src to the object
+    // pointed to by dest. memcpy(destination, source, count bytes)
+    memcpy(buf, ptr, td->n_bytes_per_row);
+    // move pointers
+    buf += td->n_bytes_per_row;
+    memset(buf, 0, td->pad_bytes_per_row);// put pad_bytes_per_row 0's into buf
+    buf += td->pad_bytes_per_row;
+    ptr += td->linesize; // ... and go back unless top-down
+  }
+  return 0;
+}
+
+// copy one tile into the packet, its rows are not padded
+static int spff_tile_slice(AVCodecContext *avctx, void *arg,
+                           int jobnr, int threadnr)
+{
+  const SPFFSliceData *td = arg;
+  int x     = jobnr % td->nb_tiles_x * td->tile_width;
+  int w     = FFMIN(td->tile_width, avctx->width - x);
+  int start = jobnr / td->nb_tiles_x * td->stripe_height;
+  int end   = FFMIN(start + td->stripe_height, td->height);
+  const uint8_t *ptr = td->src + start * td->linesize + x;
+  // the tile rows above are complete, and so are the tiles on the left
+  uint8_t *buf       = td->dst + start * avctx->width + (end - start) * x;
+  int i;
+
+  for (i = start; i < end; i++) {
+    memcpy(buf, ptr, w);
+    buf += w;
+    ptr += td->linesize;
+  }
+  return 0;
+}
+
+#if CONFIG_ZLIB
+// deflate one stripe or tile of rows into its own stream
+static int spff_deflate_slice(AVCodecContext *avctx, void *arg,
+                              int jobnr, int threadnr)
+{
+  static const uint8_t zero[4] = { 0 };
+  SPFFEncContext *s       = avctx->priv_data;
+  const SPFFSliceData *td = arg;
+  z_stream *zstream       = &s->zstream[threadnr];
+  int x     = jobnr % td->nb_tiles_x * td->tile_width;
+  int w     = FFMIN(td->tile_width, avctx->width - x);
+  int start = jobnr / td->nb_tiles_x * td->stripe_height;
+  int end   = FFMIN(start + td->stripe_height, td->height);
+  const uint8_t *ptr = td->src + start * td->linesize + x;
+  int i, ret;
+
+  if ((ret = deflateReset(zstream)) != Z_OK)
+    goto fail;
+  zstream->next_out  = td->dst + jobnr * td->stripe_size;
+  zstream->avail_out = td->stripe_size;
+  for (i = start; i < end; i++) {
+    // the output room is deflateBound() of the stripe, so every row is
+    // consumed in a single call
+    zstream->next_in  = (uint8_t *)ptr;
+    zstream->avail_in = w;
+    if ((ret = deflate(zstream, Z_NO_FLUSH)) != Z_OK || zstream->avail_in)
+      goto fail;
+    if (td->pad_bytes_per_row) {
+      zstream->next_in  = (uint8_t *)zero;
+      zstream->avail_in = td->pad_bytes_per_row;
+      if ((ret = deflate(zstream, Z_NO_FLUSH)) != Z_OK || zstream->avail_in)
+        goto fail;
+    }
+    ptr += td->linesize;
+  }
+  if ((ret = deflate(zstream, Z_FINISH)) != Z_STREAM_END)
+    goto fail;
+  td->slice_size[jobnr] = td->stripe_size - zstream->avail_out;
   return 0;
+
+fail:
+  av_log(avctx, AV_LOG_ERROR, "deflate of stripe %d failed (%d)\n", jobnr, ret);
+  td->slice_size[jobnr] = AVERROR_EXTERNAL;
+  return AVERROR_EXTERNAL;
+}
+#endif
+
+// whether a block differs from the previous picture, starting at row y
+static int spff_block_changed(AVCodecContext *avctx, const AVFrame *p,
+                              int x, int y, int w, int end)
+{
+  SPFFEncContext *s = avctx->priv_data;
+
+  for (; y < end; y++)
+    if (memcmp(p->data[0] + y * p->linesize[0] + x,
+               s->prev + y * avctx->width + x, w))
+      return 1;
+  return 0;
+}
+
+/*
+ * Find what changed since the previous picture. Each run of changed blocks
+ * in a block row gives a rect, which grows the one above instead when they
+ * cover the same columns. Returns the number of rects.
+ */
+static int spff_find_dirty_rects(AVCodecContext *avctx, const AVFrame *p,
+                                 int64_t *data_size)
+{
+  SPFFEncContext *s = avctx->priv_data;
+  int bw = (avctx->width + DELTA_BLOCK_SIZE - 1) / DELTA_BLOCK_SIZE;
+  int nb_rects = 0, size = 4;
+  int y0, y, bx, start;
+
+  for (y0 = 0; y0 < avctx->height; y0 += DELTA_BLOCK_SIZE) {
+    int end = FFMIN(y0 + DELTA_BLOCK_SIZE, avctx->height);
+
+    // most rows of a mostly static picture did not change, skip them whole
+    for (y = y0; y < end; y++)
+      if (memcmp(p->data[0] + y * p->linesize[0],
+                 s->prev + y * avctx->width, avctx->width))
+        break;
+    if (y == end)
+      continue;
+
+    for (bx = 0; bx < bw; bx = start + 1) {
+      int x, w, i;
+
+      for (start = bx; start < bw; start++) {
+        x = start * DELTA_BLOCK_SIZE;
+        if (spff_block_changed(avctx, p, x, y, FFMIN(DELTA_BLOCK_SIZE,
+                               avctx->width - x), end))
+          break;
+      }
+      if (start == bw)
+        break;
+      for (bx = start; start + 1 < bw; start++) {
+        x = (start + 1) * DELTA_BLOCK_SIZE;
+        if (!spff_block_changed(avctx, p, x, y, FFMIN(DELTA_BLOCK_SIZE,
+                                avctx->width - x), end))
+          break;
+      }
+      // blocks bx to start changed
+      x = bx * DELTA_BLOCK_SIZE;
+      w = FFMIN((start + 1) * DELTA_BLOCK_SIZE, avctx->width) - x;
+
+      i = s->open_rect[bx];
+      if (i < nb_rects && s->rects[i].x == x && s->rects[i].w == w &&
+          s->rects[i].y + s->rects[i].h == y0) {
+        s->rects[i].h += end - y0;
+      } else {
+        i = s->open_rect[bx] = nb_rects++;
+        s->rects[i].x = x;
+        s->rects[i].y = y0;
+        s->rects[i].w = w;
+        s->rects[i].h = end - y0;
+        size += 16;
+      }
+      size += w * (end - y0);
+    }
+  }
+
+  *data_size = size;
+  return nb_rects;
 }
 
 // encode one frame, spff only support one frame only
 static int spff_encode_frame(AVCodecContext *avctx, AVPacket *pkt,
 			     const AVFrame *pict, int *got_packet)
 {
-  const AVFrame * const p = pict;
-  int n_bytes_image, n_bytes_per_row, n_bytes, i, hsize, ret;
+  SPFFEncContext *s = avctx->priv_data;
+  const AVFrame *p = pict;
+  int64_t n_bytes_image, n_bytes, hsize, table_size = 0, levels_size = 0;
+  int64_t nb_tiles = 0;
+  int n_bytes_per_row, i, ihsize, ret, linesize;
+  int nb_tiles_x = 1, stripe_size = 0, nb_rects = 0, nb_stripes;
   int pad_bytes_per_row, pal_entries = 0;
+  int compression = s->compression, key = 1, tile_width, tiled;
+  int nb_levels, nb_crcs = 0, data_size;
   const uint32_t *pal = NULL;
    uint32_t palette256[256];
   int bit_count = avctx->bits_per_coded_sample;
-  uint8_t *ptr, *buf;
+  uint8_t *ptr, *buf, *table = NULL, *crcs = NULL;
+  SPFFSliceData td;
+
+  // keyframes every keyint frames, or when the caller asks for one
+  if (s->prev && p->pict_type != AV_PICTURE_TYPE_I &&
+      s->frame_num % s->keyint) {
+    key = 0;
+    compression = SPFF_DELTA;
+  } else
+    s->frame_num = 0;
+  s->frame_num++;
+
+  // raw rows are quantized straight into the packet, the other codings
+  // read the picture out of order or more than once, quantize it up front
+  if (s->quant && (compression != SPFF_RGB || s->tile_width || s->levels ||
+                   s->prev)) {
+    if (!s->quant->buf[0]) {
+      s->quant->format = AV_PIX_FMT_GRAY8;
+      s->quant->width  = avctx->width;
+      s->quant->height = avctx->height;
+      if ((ret = av_frame_get_buffer(s->quant, 32)) < 0)
+        return ret;
+    }
+    td.frame     = pict;
+    td.height    = avctx->height;
+    td.nb_slices = avctx->active_thread_type & FF_THREAD_SLICE ?
+                   FFMIN(avctx->thread_count, avctx->height) : 1;
+    avctx->execute2(avctx, spff_quantize_slice, &td, NULL, td.nb_slices);
+    p = s->quant;
+  }
 
 #if FF_API_CODED_FRAME
   FF_DISABLE_DEPRECATION_WARNINGS
-    avctx->coded_frame->pict_type = AV_PICTURE_TYPE_I;
-  avctx->coded_frame->key_frame = 1;
+    avctx->coded_frame->pict_type = key ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_P;
+  avctx->coded_frame->key_frame = key;
   FF_ENABLE_DEPRECATION_WARNINGS
 #endif
-   av_assert1(bit_count == 8); // assert correct color scheme: RGB8
-  //assign RGB values into palette256
-   avpriv_set_systematic_pal2(palette256, avctx->pix_fmt);
-   pal = palette256; // rereference pal
+   av_assert1(bit_count == 8 || bit_count == 24 || bit_count == 32);
+  //assign RGB values into palette256, inter frames reuse the previous one
+   if (bit_count == 8) {
+     avpriv_set_systematic_pal2(palette256, s->quant ? AV_PIX_FMT_BGR8 : avctx->pix_fmt);
+     if (compression != SPFF_DELTA)
+       pal = palette256; // rereference pal
+   }
    
    if (pal && !pal_entries) pal_entries = 1 << bit_count;
-   n_bytes_per_row = (int64_t)avctx->width;
-   pad_bytes_per_row = (4 - n_bytes_per_row) & 3;
+   n_bytes_per_row = avctx->width * bit_count >> 3;
+   pad_bytes_per_row = ff_spff_row_size(avctx->width, bit_count) - n_bytes_per_row;
+   // deflate stripes are tiles as wide as the picture, with padded rows
+   tile_width = avctx->width;
+   if (s->tile_width && compression != SPFF_DELTA) {
+     tile_width        = FFMIN(s->tile_width, avctx->width);
+     pad_bytes_per_row = 0;
+   }
+   // sizes are computed in 64 bits, tiny tiles and stripes take a
+   // stripe table entry each and are checked against INT_MAX below
+   nb_stripes = (avctx->height + (int64_t)s->stripe_height - 1) / s->stripe_height;
+   if (compression == SPFF_DEFLATE ||
+       (s->tile_width && compression != SPFF_DELTA)) {
+     nb_tiles_x = (avctx->width + tile_width - 1) / tile_width;
+     nb_tiles   = (int64_t)nb_tiles_x * nb_stripes;
+     table_size = (nb_tiles + 1) * 4;
+   }
    //calculate image size
-   n_bytes_image = avctx->height * (n_bytes_per_row + pad_bytes_per_row);
-
-  // STRUCTURE.field refer to the MSVC documentation for SPFFFILEHEADER
-  // and related pages.
-#define SIZE_SPFFFILEHEADER 10
-#define SIZE_SPFFINFOHEADER 16
-   // calculate header size = fileheader size + infoheader size
-  hsize = SIZE_SPFFFILEHEADER + SIZE_SPFFINFOHEADER + (pal_entries << 2);
+   n_bytes_image = (int64_t)avctx->height * (n_bytes_per_row + pad_bytes_per_row);
+   if (compression == SPFF_RLE8)
+     n_bytes_image = (int64_t)avctx->height * RLE8_MAX_ROW_SIZE(avctx->width);
+   if (compression == SPFF_DELTA)
+     nb_rects = spff_find_dirty_rects(avctx, p, &n_bytes_image);
+#if CONFIG_ZLIB
+   if (compression == SPFF_DEFLATE) {
+     // every stripe gets its worst case room, they are packed afterwards
+     stripe_size   = deflateBound(&s->zstream[0],
+                                  FFMIN(s->stripe_height, avctx->height) *
+                                  (tile_width + pad_bytes_per_row));
+     n_bytes_image = nb_tiles * stripe_size;
+   }
+#endif
+   tiled = nb_tiles && s->tile_width;
+
+   // one checksum per stripe table entry, per stripe of raw rows, or for
+   // the whole picture
+   if (s->checksums) {
+     if (nb_tiles)
+       nb_crcs = nb_tiles;
+     else if (compression == SPFF_RGB)
+       nb_crcs = nb_stripes;
+     else
+       nb_crcs = 1;
+   }
+
+   // only keyframes are coded when there are levels
+   nb_levels = s->levels;
+   for (i = 1; i <= nb_levels; i++)
+     levels_size += (int64_t)FFALIGN(AV_CEIL_RSHIFT(avctx->width, i), 4) *
+                    AV_CEIL_RSHIFT(avctx->height, i);
+   if (nb_levels)
+     levels_size += 3; // the first level starts 4-byte aligned
+
+   // uncompressed files keep the original info header
+   if (nb_crcs)
+     ihsize = SIZE_SPFFINFOHEADER_V6;
+   else if (nb_levels)
+     ihsize = SIZE_SPFFINFOHEADER_V5;
+   else if (tiled)
+     ihsize = SIZE_SPFFINFOHEADER_V4;
+   else if (compression == SPFF_DEFLATE)
+     ihsize = SIZE_SPFFINFOHEADER_V3;
+   else if (compression != SPFF_RGB)
+     ihsize = SIZE_SPFFINFOHEADER_V2;
+   else
+     ihsize = SIZE_SPFFINFOHEADER;
+   // calculate header size = fileheader size + infoheader size + stripe
+   // table + checksums + palette, rounded up so the pixel rows start aligned
+   // like the rows themselves, which lets decoders reference them in place
+  hsize = FFALIGN(SIZE_SPFFFILEHEADER + ihsize + table_size +
+                  (int64_t)nb_crcs * 4 + (pal_entries << 2),
+                  bit_count > 8 ? SPFF_TRUECOLOR_ALIGN : 4);
   n_bytes = n_bytes_image + hsize; // calculate filesize=header size+image size
-   //Check AVPacket size and/or allocate data.
-  if ((ret = ff_alloc_packet2(avctx, pkt, n_bytes, 0)) < 0)
+  if (n_bytes + levels_size > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE) {
+    av_log(avctx, AV_LOG_ERROR, "Picture too large for the chosen tiles and "
+           "stripes: %"PRId64" bytes\n", n_bytes + levels_size);
+    return AVERROR(EINVAL);
+  }
+   //Check AVPacket size and/or allocate data. Raw pictures fill the whole
+   //packet, the other codings use lavc's reused buffer and are copied out
+  if ((ret = ff_alloc_packet2(avctx, pkt, n_bytes + levels_size,
+                              compression == SPFF_RGB ? n_bytes + levels_size : 0)) < 0)
     return ret;
+  pkt->size = n_bytes;
   buf = pkt->data;
   bytestream_put_byte(&buf, 'S');                   // SPFFFILEHEADER.bfType
   bytestream_put_byte(&buf, 'F');                   // do.
   bytestream_put_le32(&buf, n_bytes);               // SPFFFILEHEADER.bfSize
   bytestream_put_le32(&buf, hsize);                 // SPFFFILEHEADER.bfOffBits
 
-  bytestream_put_le32(&buf, SIZE_SPFFINFOHEADER);   // SPFFINFOHEADER.biSize
+  bytestream_put_le32(&buf, ihsize);                // SPFFINFOHEADER.biSize
   bytestream_put_le32(&buf, avctx->width);          // SPFFINFOHEADER.biWidth
-  bytestream_put_le32(&buf, avctx->height);         // SPFFINFOHEADER.biHeight
+  bytestream_put_le32(&buf, s->top_down ? -avctx->height
+                                         : avctx->height); // SPFFINFOHEADER.biHeight
   bytestream_put_le16(&buf, 1);                     // SPFFINFOHEADER.biPlanes
-  // we choose to represent each pixel with 
-  // 3 bytes for red,green,blue. bit_count should be 24
+  // 8 for BGR8, 24 or 32 for BGR24 and BGRA
   bytestream_put_le16(&buf, bit_count);             // SPFFINFOHEADER.biBitCount
-  
-  // SPFF files are bottom-to-top so we start from the end...
-  ptr = p->data[0] + (avctx->height - 1) * p->linesize[0];
+  if (ihsize >= SIZE_SPFFINFOHEADER_V2)
+    bytestream_put_le32(&buf, compression);         // SPFFINFOHEADER.biCompression
+  if (ihsize >= SIZE_SPFFINFOHEADER_V3)
+    bytestream_put_le32(&buf, s->stripe_height);    // SPFFINFOHEADER.biStripeHeight
+  if (ihsize >= SIZE_SPFFINFOHEADER_V4)
+    bytestream_put_le32(&buf, tiled ? tile_width : 0); // SPFFINFOHEADER.biTileWidth
+  if (ihsize >= SIZE_SPFFINFOHEADER_V5) {
+    bytestream_put_le32(&buf, nb_levels);           // SPFFINFOHEADER.biLevels
+    for (i = 0; i < 3; i++)
+      bytestream_put_le32(&buf, 0);                 // SPFFINFOHEADER.biLevelOffset, filled below
+  }
+  if (ihsize >= SIZE_SPFFINFOHEADER_V6)
+    bytestream_put_le32(&buf, nb_crcs);             // SPFFINFOHEADER.biChecksums
+  table = buf;                                      // stripe offsets, filled below
+  buf  += table_size;
+  crcs  = buf;                                      // checksums, filled below
+  buf  += nb_crcs * 4;
+  for (i = 0; i < pal_entries; i++)
+    bytestream_put_le32(&buf, pal[i] & 0xFFFFFF);
+  memset(buf, 0, pkt->data + hsize - buf);         // alignment padding
+
   buf = pkt->data + hsize;
-  for(i = 0; i < avctx->height; i++) {
-    //bit_count is always 8
-    {
-      // copies count bytes from the object pointed to by src to the object 
-      // pointed to by dest. memcpy(destination, source, count bytes)
-      memcpy(buf, ptr, n_bytes_per_row);
+  if (s->top_down) {
+    ptr = p->data[0];
+    linesize = p->linesize[0];
+  } else {
+    // SPFF files are bottom-to-top by default so we start from the end...
+    ptr = p->data[0] + (avctx->height - 1) * p->linesize[0];
+    linesize = -p->linesize[0];
+  }
+
+  // rows are independent, split them into bands for the slice threads
+  td.src               = ptr;
+  td.dst               = buf;
+  td.linesize          = linesize;
+  td.n_bytes_per_row   = n_bytes_per_row;
+  td.pad_bytes_per_row = pad_bytes_per_row;
+  td.height            = avctx->height;
+  td.nb_slices         = avctx->active_thread_type & FF_THREAD_SLICE ?
+                         FFMIN(avctx->thread_count, avctx->height) : 1;
+  td.stripe_height     = s->stripe_height;
+  td.stripe_size       = stripe_size;
+  td.tile_width        = tile_width;
+  td.nb_tiles_x        = nb_tiles_x;
+  td.frame             = s->quant && p == pict ? pict : NULL;
+
+  av_fast_malloc(&s->slice_size, &s->slice_size_alloc,
+                 FFMAX(td.nb_slices, nb_tiles) * sizeof(*s->slice_size));
+  if (!s->slice_size)
+    return AVERROR(ENOMEM);
+  td.slice_size = s->slice_size;
+
+  if (compression == SPFF_DELTA) {
+    // changed areas go to the packet and update the reference as well
+    bytestream_put_le32(&buf, nb_rects);
+    for (i = 0; i < nb_rects; i++) {
+      const SPFFRect *r = &s->rects[i];
+      int y;
+
+      bytestream_put_le32(&buf, r->x);
+      bytestream_put_le32(&buf, r->y);
+      bytestream_put_le32(&buf, r->w);
+      bytestream_put_le32(&buf, r->h);
+      for (y = r->y; y < r->y + r->h; y++) {
+        ptr = p->data[0] + y * p->linesize[0] + r->x;
+        memcpy(s->prev + y * avctx->width + r->x, ptr, r->w);
+        bytestream_put_buffer(&buf, ptr, r->w);
+      }
     }
-    // move pointers
-    buf += n_bytes_per_row;
-    memset(buf, 0, pad_bytes_per_row);// put pad_bytes_per_row 0's into buf
-    buf += pad_bytes_per_row;
-    ptr -= p->linesize[0]; // ... and go back
+  } else if (compression == SPFF_DEFLATE) {
+#if CONFIG_ZLIB
+    int offset = 0;
+
+    avctx->execute2(avctx, spff_deflate_slice, &td, NULL, nb_tiles);
+
+    // pack the stripes and record where each one starts
+    for (i = 0; i < nb_tiles; i++) {
+      if (s->slice_size[i] < 0)
+        return s->slice_size[i];
+      memmove(buf + offset, td.dst + i * stripe_size, s->slice_size[i]);
+      AV_WL32(table + 4 * i, offset);
+      offset += s->slice_size[i];
+    }
+    AV_WL32(table + 4 * nb_tiles, offset);
+    pkt->size = hsize + offset;
+    AV_WL32(pkt->data + 2, pkt->size);              // SPFFFILEHEADER.bfSize
+#endif
+  } else if (compression == SPFF_RLE8) {
+    avctx->execute2(avctx, spff_rle8_slice, &td, NULL, td.nb_slices);
+
+    // pack the bands written at their worst case offsets back to back
+    buf += s->slice_size[0];
+    for (i = 1; i < td.nb_slices; i++) {
+      int start = (td.height * i) / td.nb_slices;
+      memmove(buf, td.dst + start * RLE8_MAX_ROW_SIZE(avctx->width),
+              s->slice_size[i]);
+      buf += s->slice_size[i];
+    }
+    pkt->size = buf - pkt->data;
+    AV_WL32(pkt->data + 2, pkt->size);              // SPFFFILEHEADER.bfSize
+  } else if (nb_tiles) {
+    avctx->execute2(avctx, spff_tile_slice, &td, NULL, nb_tiles);
+
+    // raw tiles have a known size, tiles of the last tile row may be shorter
+    for (i = 0; i < nb_tiles; i++) {
+      int start = i / nb_tiles_x * s->stripe_height;
+      int rows  = FFMIN(s->stripe_height, avctx->height - start);
+      AV_WL32(table + 4 * i, start * avctx->width +
+                             rows * (i % nb_tiles_x) * tile_width);
+    }
+    AV_WL32(table + 4 * nb_tiles, n_bytes_image);
+  } else
+    avctx->execute2(avctx, spff_encode_slice, &td, NULL, td.nb_slices);
+
+  // the checksums stop at the first level, padding included
+  data_size = nb_levels ? FFALIGN(pkt->size - hsize, 4) : pkt->size - hsize;
+
+  if (nb_levels) {
+    // thumbnails follow the picture, raw and in the same row order
+    const uint8_t *src = p->data[0];
+    int src_linesize   = p->linesize[0];
+    int offset         = FFALIGN(pkt->size - hsize, 4);
+    uint8_t *level     = s->level_buf;
+
+    memset(pkt->data + pkt->size, 0, hsize + offset - pkt->size);
+    for (i = 1; i <= nb_levels; i++) {
+      int w      = AV_CEIL_RSHIFT(avctx->width,  i);
+      int h      = AV_CEIL_RSHIFT(avctx->height, i);
+      int stride = FFALIGN(w, 4);
+      int y;
+
+      ff_spff_downscale(level, w, src, src_linesize,
+                        AV_CEIL_RSHIFT(avctx->width,  i - 1),
+                        AV_CEIL_RSHIFT(avctx->height, i - 1),
+                        s->quant ? AV_PIX_FMT_BGR8 : avctx->pix_fmt);
+      AV_WL32(pkt->data + SIZE_SPFFFILEHEADER + 32 + 4 * (i - 1), offset);
+      buf = pkt->data + hsize + offset;
+      for (y = 0; y < h; y++) {
+        memcpy(buf, level + (s->top_down ? y : h - 1 - y) * w, w);
+        memset(buf + w, 0, stride - w);
+        buf += stride;
+      }
+      offset += stride * h;
+      src          = level;
+      src_linesize = w;
+      level       += w * h;
+    }
+    pkt->size = hsize + offset;
+    AV_WL32(pkt->data + 2, pkt->size);              // SPFFFILEHEADER.bfSize
+  }
+
+  if (nb_crcs) {
+    SPFFChecksumData cd = {
+      .c           = &s->crc,
+      .data        = pkt->data + hsize,
+      .size        = data_size,
+      .offsets     = nb_tiles ? table : NULL,
+      .stripe_size = FFMIN(s->stripe_height, avctx->height) *
+                     (n_bytes_per_row + pad_bytes_per_row),
+      .nb_stripes  = nb_crcs,
+      .crcs        = crcs,
+    };
+    avctx->execute2(avctx, ff_spff_checksum_stripe, &cd, NULL, nb_crcs);
   }
 
-  pkt->flags |= AV_PKT_FLAG_KEY; // bitwise OR for flag values
+  // keep the picture around for the inter frames that follow
+  if (key && s->prev)
+    av_image_copy_plane(s->prev, avctx->width, p->data[0], p->linesize[0],
+                        avctx->width, avctx->height);
+
+  if (key)
+    pkt->flags |= AV_PKT_FLAG_KEY; // bitwise OR for flag values
   *got_packet = 1;
   return 0;
 }
 
+#define OFFSET(x) offsetof(SPFFEncContext, x)
+#define VE AV_OPT_FLAG_VIDEO_PARAM | AV_OPT_FLAG_ENCODING_PARAM
+static const AVOption options[] = {
+  { "top_down", "store rows top-down instead of bottom-up",
+    OFFSET(top_down), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+  { "compression", "pixel data compression", OFFSET(compression),
+    AV_OPT_TYPE_INT, { .i64 = SPFF_RGB }, SPFF_RGB, SPFF_DEFLATE, VE, "compression" },
+    { "raw",  "uncompressed rows", 0, AV_OPT_TYPE_CONST, { .i64 = SPFF_RGB  }, 0, 0, VE, "compression" },
+    { "rle8", "run-length coded", 0, AV_OPT_TYPE_CONST, { .i64 = SPFF_RLE8 }, 0, 0, VE, "compression" },
+    { "deflate", "deflated stripes", 0, AV_OPT_TYPE_CONST, { .i64 = SPFF_DEFLATE }, 0, 0, VE, "compression" },
+  { "stripe_height", "rows per independently deflated stripe",
+    OFFSET(stripe_height), AV_OPT_TYPE_INT, { .i64 = 64 }, 1, INT_MAX, VE },
+  { "dither", "ordered dithering when quantizing RGB24 or YUV input to 3-3-2",
+    OFFSET(dither), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+  { "levels", "number of halved copies stored after the picture for low resolution decoding",
+    OFFSET(levels), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, 3, VE },
+  { "tile_width", "cut the picture into tiles this wide and stripe_height high, 0 to disable",
+    OFFSET(tile_width), AV_OPT_TYPE_INT, { .i64 = 0 }, 0, INT_MAX, VE },
+  { "keyint", "maximum interval between keyframes, other frames only store what changed",
+    OFFSET(keyint), AV_OPT_TYPE_INT, { .i64 = 1 }, 1, INT_MAX, VE },
+  { "checksums", "store a CRC-32C of every stripe for the decoder to check",
+    OFFSET(checksums), AV_OPT_TYPE_BOOL, { .i64 = 0 }, 0, 1, VE },
+  { NULL },
+};
+
+static const AVClass spffenc_class = {
+  .class_name = "spff encoder",
+  .item_name  = av_default_item_name,
+  .option     = options,
+  .version    = LIBAVUTIL_VERSION_INT,
+  .category   = AV_CLASS_CATEGORY_ENCODER,
+};
+
 AVCodec ff_spff_encoder = {
   .name           = "spff",
   .long_name      = NULL_IF_CONFIG_SMALL("SPFF image (a project for CS 3505)"),
   .type           = AVMEDIA_TYPE_VIDEO,
   .id             = AV_CODEC_ID_SPFF,
+  .priv_data_size = sizeof(SPFFEncContext),
   .init           = spff_encode_init,
   .encode2        = spff_encode_frame,
-  .pix_fmts       = (const enum AVPixelFormat[]){AV_PIX_FMT_RGB8, AV_PIX_FMT_BGR8,AV_PIX_FMT_NONE},
+  .close          = spff_encode_close,
+  .caps_internal  = FF_CODEC_CAP_INIT_CLEANUP,
+  // inter frames need the previous picture, threads only split up a frame
+  .capabilities   = AV_CODEC_CAP_SLICE_THREADS,
+  .pix_fmts       = (const enum AVPixelFormat[]){AV_PIX_FMT_RGB8, AV_PIX_FMT_BGR8,
+                                                 AV_PIX_FMT_RGB24, AV_PIX_FMT_YUV420P,
+                                                 AV_PIX_FMT_YUVJ420P, AV_PIX_FMT_BGR24,
+                                                 AV_PIX_FMT_BGRA, AV_PIX_FMT_NONE},
+  .priv_class     = &spffenc_class,
 };
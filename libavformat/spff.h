@@ -0,0 +1,49 @@
+/*
+ * CS 3505 Spring 2017
+ * SPFF sequence container common definitions
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef AVFORMAT_SPFF_H
+#define AVFORMAT_SPFF_H
+
+#include <stdint.h>
+
+#include "libavutil/common.h"
+
+/* A sequence is the SPFF files of the frames back to back, so it starts like
+ * a single picture, followed by the index, one entry per frame:
+ *     le64 position, le32 size, le32 flags, le64 pts
+ * and by the trailer:
+ *     le64 index position, le32 frame count,
+ *     le32 time base num, le32 time base den, le32 SPFF_SEQ_TAG */
+#define SPFF_SEQ_TAG          MKTAG('S', 'F', 'I', 'X')
+#define SPFF_SEQ_ENTRY_SIZE   24
+#define SPFF_SEQ_TRAILER_SIZE 24
+
+#define SPFF_SEQ_FLAG_KEY 1
+
+typedef struct SPFFSeqEntry {
+    int64_t pos;
+    int64_t pts;
+    int size;
+    int flags;
+} SPFFSeqEntry;
+
+#endif /* AVFORMAT_SPFF_H */
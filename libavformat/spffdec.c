@@ -0,0 +1,426 @@
+/*
+ * CS 3505 Spring 2017
+ * piped SPFF demuxer
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * SPFF demuxers, concatenated images split into packets by the SPFF parser
+ * and indexed sequences read from a memory mapping
+ */
+
+#include "config.h"
+
+#if HAVE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "libavutil/buffer.h"
+#include "libavutil/intreadwrite.h"
+#include "libavutil/opt.h"
+#include "avformat.h"
+#include "avio_internal.h"
+#include "internal.h"
+#include "spff.h"
+#include "url.h"
+
+typedef struct SPFFPipeContext {
+    const AVClass *class;
+    AVRational framerate;
+    int chunk_size;
+} SPFFPipeContext;
+
+typedef struct SPFFSeqContext {
+    SPFFSeqEntry *entries;
+    int nb_entries;
+    int cur;
+    AVBufferRef *map; // the whole file, when it could be mapped
+} SPFFSeqContext;
+
+// whether the probe buffer starts with the headers of an SPFF file
+static int spff_check_header(AVProbeData *p)
+{
+    const uint8_t *b = p->buf;
+    unsigned int hsize, ihsize;
+
+    if (p->buf_size < 26 || AV_RB16(b) != (('S' << 8) | 'F'))
+        return 0;
+
+    hsize  = AV_RL32(b + 6);
+    ihsize = AV_RL32(b + 10);
+    // any info header version, as long as it fits in the headers
+    if (ihsize < 16 || hsize < 10 || ihsize > hsize - 10 ||
+        AV_RL32(b + 2) <= hsize)
+        return 0;
+    if (AV_RL16(b + 22) != 1 ||
+        (AV_RL16(b + 24) != 8 && AV_RL16(b + 24) != 24 && AV_RL16(b + 24) != 32))
+        return 0;
+
+    return 1;
+}
+
+static int spff_probe(AVProbeData *p)
+{
+    return spff_check_header(p) ? AVPROBE_SCORE_EXTENSION + 1 : 0;
+}
+
+static int spff_read_header(AVFormatContext *s)
+{
+    SPFFPipeContext *spff = s->priv_data;
+    AVStream *st;
+
+    st = avformat_new_stream(s, NULL);
+    if (!st)
+        return AVERROR(ENOMEM);
+
+    st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    st->codecpar->codec_id   = AV_CODEC_ID_SPFF;
+    // packets are cut where bfSize says a file ends
+    st->need_parsing         = AVSTREAM_PARSE_FULL_RAW;
+    avpriv_set_pts_info(st, 64, spff->framerate.den, spff->framerate.num);
+
+    return 0;
+}
+
+static int spff_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    SPFFPipeContext *spff = s->priv_data;
+    int ret;
+
+    if ((ret = av_new_packet(pkt, spff->chunk_size)) < 0)
+        return ret;
+
+    // whatever is available, the end of an image must not wait for the
+    // next one to fill the chunk
+    ret = avio_read_partial(s->pb, pkt->data, spff->chunk_size);
+    if (ret <= 0) {
+        av_packet_unref(pkt);
+        return ret < 0 ? ret : AVERROR_EOF;
+    }
+    av_shrink_packet(pkt, ret);
+    pkt->stream_index = 0;
+
+    return ret;
+}
+
+#define OFFSET(x) offsetof(SPFFPipeContext, x)
+#define DEC AV_OPT_FLAG_DECODING_PARAM
+static const AVOption options[] = {
+    { "framerate",  "set the video framerate", OFFSET(framerate),
+      AV_OPT_TYPE_VIDEO_RATE, { .str = "25" }, 0, INT_MAX, DEC },
+    { "chunk_size", "bytes read at once from the pipe", OFFSET(chunk_size),
+      AV_OPT_TYPE_INT, { .i64 = 4096 }, 1, INT_MAX, DEC },
+    { NULL },
+};
+
+static const AVClass spff_pipe_class = {
+    .class_name = "spff_pipe demuxer",
+    .item_name  = av_default_item_name,
+    .option     = options,
+    .version    = LIBAVUTIL_VERSION_INT,
+};
+
+AVInputFormat ff_spff_pipe_demuxer = {
+    .name           = "spff_pipe",
+    .long_name      = NULL_IF_CONFIG_SMALL("piped spff sequence"),
+    .priv_data_size = sizeof(SPFFPipeContext),
+    .read_probe     = spff_probe,
+    .read_header    = spff_read_header,
+    .read_packet    = spff_read_packet,
+    .flags          = AVFMT_GENERIC_INDEX,
+    .priv_class     = &spff_pipe_class,
+};
+
+// a sequence starts like a single picture, only the extension tells them apart
+static int spff_seq_probe(AVProbeData *p)
+{
+    if (!spff_check_header(p) || !av_match_ext(p->filename, "spfs"))
+        return 0;
+    return AVPROBE_SCORE_EXTENSION + 2;
+}
+
+#if HAVE_MMAP
+static void spff_seq_unmap(void *opaque, uint8_t *data)
+{
+    munmap(data, (size_t)(uintptr_t)opaque);
+}
+#endif
+
+// map the local file pb reads so that packets can point into the mapping,
+// anything else, custom IO included, is read through pb
+static int spff_seq_map(AVFormatContext *s)
+{
+#if HAVE_MMAP
+    SPFFSeqContext *seq = s->priv_data;
+    URLContext *h;
+    struct stat st;
+    void *buf;
+    int fd;
+
+    if (s->flags & AVFMT_FLAG_CUSTOM_IO)
+        return AVERROR(ENOSYS);
+    h = ffio_geturlcontext(s->pb);
+    if (!h || strcmp(h->prot->name, "file"))
+        return AVERROR(ENOSYS);
+    // the descriptor pb has open, not whatever s->filename names now
+    fd = ffurl_get_file_handle(h);
+    if (fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        !st.st_size || st.st_size > INT_MAX)
+        return AVERROR(ENOSYS);
+
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED)
+        return AVERROR(errno);
+    seq->map = av_buffer_create(buf, st.st_size, spff_seq_unmap,
+                                (void *)(uintptr_t)st.st_size,
+                                AV_BUFFER_FLAG_READONLY);
+    if (!seq->map) {
+        munmap(buf, st.st_size);
+        return AVERROR(ENOMEM);
+    }
+    return 0;
+#else
+    return AVERROR(ENOSYS);
+#endif
+}
+
+static int spff_seq_read_index(AVFormatContext *s)
+{
+    SPFFSeqContext *seq = s->priv_data;
+    uint8_t trailer[SPFF_SEQ_TRAILER_SIZE];
+    uint8_t *index_buf = NULL;
+    const uint8_t *t, *idx;
+    int64_t size, index_pos;
+    unsigned int nb_entries;
+    AVRational tb;
+    AVStream *st;
+    int i;
+
+    if (spff_seq_map(s) >= 0) {
+        size = seq->map->size;
+        if (size < SPFF_SEQ_TRAILER_SIZE)
+            return AVERROR_INVALIDDATA;
+        t = seq->map->data + size - SPFF_SEQ_TRAILER_SIZE;
+    } else {
+        // not a local file, read the index through the protocol
+        size = avio_size(s->pb);
+        if (size < SPFF_SEQ_TRAILER_SIZE ||
+            avio_seek(s->pb, size - SPFF_SEQ_TRAILER_SIZE, SEEK_SET) < 0 ||
+            avio_read(s->pb, trailer, SPFF_SEQ_TRAILER_SIZE) !=
+            SPFF_SEQ_TRAILER_SIZE) {
+            av_log(s, AV_LOG_ERROR, "could not read the index, "
+                   "the input must be seekable\n");
+            return AVERROR(EIO);
+        }
+        t = trailer;
+    }
+
+    index_pos  = AV_RL64(t);
+    nb_entries = AV_RL32(t + 8);
+    tb.num     = AV_RL32(t + 12);
+    tb.den     = AV_RL32(t + 16);
+    if (AV_RL32(t + 20) != SPFF_SEQ_TAG) {
+        av_log(s, AV_LOG_ERROR, "no index at the end of the file\n");
+        return AVERROR_INVALIDDATA;
+    }
+    if (index_pos < 0 || index_pos > size - SPFF_SEQ_TRAILER_SIZE ||
+        size - SPFF_SEQ_TRAILER_SIZE - index_pos !=
+        (int64_t)nb_entries * SPFF_SEQ_ENTRY_SIZE ||
+        nb_entries > INT_MAX / sizeof(*seq->entries) ||
+        tb.num <= 0 || tb.den <= 0) {
+        av_log(s, AV_LOG_ERROR, "invalid index\n");
+        return AVERROR_INVALIDDATA;
+    }
+
+    if (seq->map) {
+        idx = seq->map->data + index_pos;
+    } else {
+        index_buf = av_malloc(nb_entries * SPFF_SEQ_ENTRY_SIZE + 1);
+        if (!index_buf)
+            return AVERROR(ENOMEM);
+        if (avio_seek(s->pb, index_pos, SEEK_SET) < 0 ||
+            avio_read(s->pb, index_buf, nb_entries * SPFF_SEQ_ENTRY_SIZE) !=
+            nb_entries * SPFF_SEQ_ENTRY_SIZE) {
+            av_free(index_buf);
+            return AVERROR(EIO);
+        }
+        idx = index_buf;
+    }
+
+    seq->entries = av_malloc_array(nb_entries + 1, sizeof(*seq->entries));
+    if (!seq->entries) {
+        av_free(index_buf);
+        return AVERROR(ENOMEM);
+    }
+    for (i = 0; i < nb_entries; i++, idx += SPFF_SEQ_ENTRY_SIZE) {
+        SPFFSeqEntry *e = &seq->entries[i];
+        e->pos   = AV_RL64(idx);
+        e->size  = AV_RL32(idx + 8);
+        e->flags = AV_RL32(idx + 12);
+        e->pts   = AV_RL64(idx + 16);
+        if (e->pos < 0 || e->size <= 0 || e->pos > index_pos - e->size ||
+            (i && e->pts <= seq->entries[i - 1].pts)) {
+            av_log(s, AV_LOG_ERROR, "invalid index entry %d\n", i);
+            av_free(index_buf);
+            return AVERROR_INVALIDDATA;
+        }
+    }
+    av_free(index_buf);
+    seq->nb_entries = nb_entries;
+
+    st = avformat_new_stream(s, NULL);
+    if (!st)
+        return AVERROR(ENOMEM);
+    st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+    st->codecpar->codec_id   = AV_CODEC_ID_SPFF;
+    st->nb_frames            = nb_entries;
+    avpriv_set_pts_info(st, 64, tb.num, tb.den);
+    if (nb_entries)
+        st->start_time = seq->entries[0].pts;
+
+    return 0;
+}
+
+static int spff_seq_read_close(AVFormatContext *s)
+{
+    SPFFSeqContext *seq = s->priv_data;
+
+    av_buffer_unref(&seq->map);
+    av_freep(&seq->entries);
+    return 0;
+}
+
+static int spff_seq_read_header(AVFormatContext *s)
+{
+    int ret = spff_seq_read_index(s);
+
+    // read_close is not called when opening fails
+    if (ret < 0)
+        spff_seq_read_close(s);
+    return ret;
+}
+
+static int spff_seq_read_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    SPFFSeqContext *seq = s->priv_data;
+    SPFFSeqEntry *e;
+    int ret;
+
+    if (seq->cur >= seq->nb_entries)
+        return AVERROR_EOF;
+    e = &seq->entries[seq->cur];
+
+    if (seq->map) {
+        // no copy, the packet keeps the mapping alive; the next frame or
+        // at least the index and trailer are there to read as padding
+        av_init_packet(pkt);
+        pkt->buf = av_buffer_ref(seq->map);
+        if (!pkt->buf)
+            return AVERROR(ENOMEM);
+        pkt->data = seq->map->data + e->pos;
+        pkt->size = e->size;
+    } else {
+        if (avio_seek(s->pb, e->pos, SEEK_SET) < 0)
+            return AVERROR(EIO);
+        if ((ret = av_get_packet(s->pb, pkt, e->size)) < 0)
+            return ret;
+        if (ret != e->size) {
+            av_packet_unref(pkt);
+            return AVERROR_INVALIDDATA;
+        }
+    }
+
+    pkt->stream_index = 0;
+    pkt->pts          = e->pts;
+    pkt->dts          = e->pts;
+    pkt->pos          = e->pos;
+    if (e->flags & SPFF_SEQ_FLAG_KEY)
+        pkt->flags |= AV_PKT_FLAG_KEY;
+    seq->cur++;
+
+    return 0;
+}
+
+// index of the last frame at or before timestamp, -1 if there is none
+static int spff_seq_search(SPFFSeqContext *seq, int64_t timestamp)
+{
+    int64_t i = timestamp - seq->entries[0].pts;
+    int lo = 0, hi = seq->nb_entries - 1;
+
+    // frames are usually numbered one after the other, then the timestamp
+    // gives the entry directly
+    if (i >= 0 && i < seq->nb_entries && seq->entries[i].pts == timestamp)
+        return i;
+
+    if (timestamp < seq->entries[0].pts)
+        return -1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) >> 1;
+        if (seq->entries[mid].pts <= timestamp)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+static int spff_seq_read_seek(AVFormatContext *s, int stream_index,
+                              int64_t timestamp, int flags)
+{
+    SPFFSeqContext *seq = s->priv_data;
+    int i;
+
+    if (!seq->nb_entries)
+        return AVERROR(EINVAL);
+
+    i = spff_seq_search(seq, timestamp);
+    if (!(flags & AVSEEK_FLAG_BACKWARD) &&
+        (i < 0 || seq->entries[i].pts != timestamp))
+        i++;
+
+    // delta frames need the frames since the last key frame
+    if (!(flags & AVSEEK_FLAG_ANY)) {
+        if (flags & AVSEEK_FLAG_BACKWARD)
+            while (i >= 0 && !(seq->entries[i].flags & SPFF_SEQ_FLAG_KEY))
+                i--;
+        else
+            while (i < seq->nb_entries &&
+                   !(seq->entries[i].flags & SPFF_SEQ_FLAG_KEY))
+                i++;
+    }
+    if (i < 0 || i >= seq->nb_entries)
+        return AVERROR(EINVAL);
+
+    seq->cur = i;
+    return 0;
+}
+
+AVInputFormat ff_spff_seq_demuxer = {
+    .name           = "spff_seq",
+    .long_name      = NULL_IF_CONFIG_SMALL("spff sequence with index"),
+    .extensions     = "spfs",
+    .priv_data_size = sizeof(SPFFSeqContext),
+    .read_probe     = spff_seq_probe,
+    .read_header    = spff_seq_read_header,
+    .read_packet    = spff_seq_read_packet,
+    .read_seek      = spff_seq_read_seek,
+    .read_close     = spff_seq_read_close,
+};
@@ -0,0 +1,118 @@
+/*
+ * CS 3505 Spring 2017
+ * SPFF sequence muxer
+ * By Minh Pham and To Tang
+ *
+ * This file is part of FFmpeg.
+ *
+ * FFmpeg is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * FFmpeg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with FFmpeg; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/**
+ * @file
+ * SPFF sequence muxer, the frames back to back followed by an index
+ */
+
+#include "libavutil/mem.h"
+#include "avformat.h"
+#include "internal.h"
+#include "spff.h"
+
+typedef struct SPFFSeqMuxContext {
+    SPFFSeqEntry *entries;
+    int nb_entries;
+    int entries_alloc;
+} SPFFSeqMuxContext;
+
+static int spff_seq_write_header(AVFormatContext *s)
+{
+    if (s->nb_streams != 1 ||
+        s->streams[0]->codecpar->codec_id != AV_CODEC_ID_SPFF) {
+        av_log(s, AV_LOG_ERROR, "only a single spff stream is supported\n");
+        return AVERROR(EINVAL);
+    }
+    return 0;
+}
+
+static int spff_seq_write_packet(AVFormatContext *s, AVPacket *pkt)
+{
+    SPFFSeqMuxContext *seq = s->priv_data;
+    SPFFSeqEntry *e;
+    int ret;
+
+    if (seq->nb_entries == seq->entries_alloc) {
+        int alloc = FFMAX(2 * seq->entries_alloc, 64);
+        if ((ret = av_reallocp_array(&seq->entries, alloc,
+                                     sizeof(*seq->entries))) < 0) {
+            seq->nb_entries = seq->entries_alloc = 0;
+            return ret;
+        }
+        seq->entries_alloc = alloc;
+    }
+
+    e        = &seq->entries[seq->nb_entries];
+    e->pos   = avio_tell(s->pb);
+    e->size  = pkt->size;
+    e->flags = pkt->flags & AV_PKT_FLAG_KEY ? SPFF_SEQ_FLAG_KEY : 0;
+    e->pts   = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : seq->nb_entries;
+    seq->nb_entries++;
+
+    avio_write(s->pb, pkt->data, pkt->size);
+    return 0;
+}
+
+static int spff_seq_write_trailer(AVFormatContext *s)
+{
+    SPFFSeqMuxContext *seq = s->priv_data;
+    AVStream *st           = s->streams[0];
+    int64_t index_pos      = avio_tell(s->pb);
+    int i;
+
+    for (i = 0; i < seq->nb_entries; i++) {
+        avio_wl64(s->pb, seq->entries[i].pos);
+        avio_wl32(s->pb, seq->entries[i].size);
+        avio_wl32(s->pb, seq->entries[i].flags);
+        avio_wl64(s->pb, seq->entries[i].pts);
+    }
+
+    avio_wl64(s->pb, index_pos);
+    avio_wl32(s->pb, seq->nb_entries);
+    avio_wl32(s->pb, st->time_base.num);
+    avio_wl32(s->pb, st->time_base.den);
+    avio_wl32(s->pb, SPFF_SEQ_TAG);
+    avio_flush(s->pb);
+
+    return 0;
+}
+
+static void spff_seq_deinit(AVFormatContext *s)
+{
+    SPFFSeqMuxContext *seq = s->priv_data;
+
+    av_freep(&seq->entries);
+}
+
+AVOutputFormat ff_spff_seq_muxer = {
+    .name           = "spff_seq",
+    .long_name      = NULL_IF_CONFIG_SMALL("spff sequence with index"),
+    .extensions     = "spfs",
+    .priv_data_size = sizeof(SPFFSeqMuxContext),
+    .audio_codec    = AV_CODEC_ID_NONE,
+    .video_codec    = AV_CODEC_ID_SPFF,
+    .write_header   = spff_seq_write_header,
+    .write_packet   = spff_seq_write_packet,
+    .write_trailer  = spff_seq_write_trailer,
+    .deinit         = spff_seq_deinit,
+};